@@ -16,12 +16,67 @@
 //
 
 struct bus_periodic_read
+{
+    uint8_t slave;      // Modbus Slave address
+    uint8_t function;   // Modbus function to use
+    uint16_t address;   // Modbus first address to process
+    uint16_t interval;     // The interval between reads
+    uint8_t type;          // enum periodic_read_type, optionally with PERIODIC_READ_WORD_SWAP
+    uint8_t filter;        // enum periodic_filter
+    uint16_t filter_value; // Bit mask or deadband of the filter
+    uint64_t last_data;    // Last data read, most significant register first
+    uint64_t reported;     // Last data reported to the host, the filter reference
+    bool valid;            // If last_data has been read at least once
+    TickType_t updated_at; // When last_data was read
+};
+
+/**
+ * A group of periodic reads on the same slave, function and interval, with close addresses,
+ * that are read in a single Modbus transaction.
+ */
+struct bus_periodic_group
 {
     uint8_t slave;       // Modbus Slave address
     uint8_t function;    // Modbus function to use
-    uint16_t address;    // Modbus first address to process
-    TickType_t next_run; // When this periodic read needs to run
-    uint16_t last_data;  // Last data read
+    uint16_t address;    // First register/coil read
+    uint16_t quantity;   // Number of registers/coils read
+    uint16_t interval;   // The interval between reads
+    TickType_t next_run; // When this group needs to run
+    bool burst;             // If this group is polled at the burst interval
+    TickType_t burst_until; // When the burst polling of this group ends
+    uint8_t heap_index;  // Position of this group in the periodic_heap
+    uint8_t reads_index; // Index of the first periodic read in this group
+    uint8_t reads_len;   // Number of periodic reads in this group
+    uint8_t frame_size;  // Size of the request frame, 0 if it could not be created
+    uint8_t frame[MODBUS_READ_REQUEST_SIZE]; // Request frame with CRC, ready to send
+};
+
+/**
+ * A command queued to a bus, stamped on arrival.
+ */
+struct bus_command
+{
+    struct m_command command;
+    bool expires;        // If the command has a deadline
+    TickType_t deadline; // When the command is no longer worth running
+    void *block;         // Heap allocated m_block_read/m_block_write/m_raw of a command, NULL otherwise
+};
+
+/**
+ * State of a slave in the bus.
+ */
+struct bus_slave
+{
+    bool used;             // If this entry is in use
+    uint8_t slave;         // Modbus Slave address
+    uint32_t srtt_us;      // Smoothed slave response latency, 0 if there is no sample yet
+    uint32_t rttvar_us;    // Slave response latency variance
+    bool offline;          // If the slave stopped answering
+    uint8_t timeouts;      // Consecutive timeouts
+    uint16_t backoff;      // Interval between probes while offline
+    TickType_t next_probe; // When the next probe of an offline slave is due
+    bool no_mask_write;    // Answered Illegal Function to a Mask Write Register, emulated with a read then a write
+    bool no_read_write;    // Answered Illegal Function to a Read/Write Multiple Registers, emulated with a write then a read
 };
 
 struct bus_context
@@ -29,8 +84,24 @@ struct bus_context
     struct pio_uart *pio_uart;
     uint32_t baudrate;
     uint8_t bus;
-    uint16_t periodic_interval;
+    uint16_t periodic_interval; // Default interval of periodic reads
+    uint8_t periodic_max_gap;   // Max unused registers/coils between reads of the same group
+    uint16_t burst_interval;    // Interval of periodic reads after a change, 0 disables burst polling
+    uint16_t burst_window;      // How long burst polling lasts after the last change
+    bool burst_slave;           // If a change bursts all groups of the slave, not only the changed one
+    uint8_t retry_max;          // Extra attempts of a command transaction that may succeed on retry
+    uint16_t retry_backoff;     // Delay before the first retry, doubled on each retry
     QueueHandle_t command_queue;
+    uint8_t pending_len;
+    struct bus_command pending[BUS_PENDING_COMMANDS]; // Commands moved from command_queue, in order
+    bool running_write;    // If the command being run may change the coils/registers of running_slave
+    uint8_t running_slave; // Slave of the command being run
+    uint8_t periodic_groups_len;
+    struct bus_periodic_group *periodic_groups;
+    struct bus_periodic_group **periodic_heap; // Groups ordered by next_run
+    struct bus_slave slaves[BUS_MAX_SLAVES];
+    uint32_t last_frame_us; // When the last frame in the bus ended
+    uint8_t rx_buffer[BUS_MODBUS_FRAME_BUFFER_SIZE]; // Received frame, replies point into it until the next transaction
     uint8_t periodic_reads_len;
     struct bus_periodic_read periodic_reads[];
 };
@@ -43,6 +114,13 @@ void bus_init(struct bus_context *bus_cfg);
 
 struct bus_context *bus_get_context(uint8_t bus);
 
-void process_periodic_reply(uint8_t bus, struct bus_periodic_read *p_read, struct modbus_frame *frame);
+/**
+ * Read a value from the periodic reads cache of a bus, if it is not older than max_age ms.
+ * Safe to call from other tasks.
+ * @return false if the value is not cached, is too old, or a write to the slave is not done yet.
+ */
+bool bus_cache_read(uint8_t bus, const struct m_device *device, uint16_t max_age, uint16_t *data);
+
+void process_periodic_reply(struct bus_context *bus_context, struct bus_periodic_group *group, struct modbus_frame *frame);
 
 #endif // BUS_H_
\ No newline at end of file
@@ -15,16 +15,37 @@
 // Bus Configuration
 //
 
-#define BUS_MODBUS_FRAME_BUFFER_SIZE 64
+// Full Modbus RTU ADU, the largest frame in the bus
+#define BUS_MODBUS_FRAME_BUFFER_SIZE 256
+// Max slaves per bus with response timing tracked
+#define BUS_MAX_SLAVES 32
 
 // After how many ms we will print the timeout message again
 #define BUS_DELAY_TIMEOUT_MSG 5000
-// After how many ms we will consider the modbus command has timed out
+// After how many ms we will consider the modbus command has timed out, the max adaptive timeout
 #define BUS_TIMEOUT_RESPONSE 100
-// How many ms we will wait after writing to UART before reading
-#define BUS_DELAY_WRITE_READ 3
+// Min adaptive timeout in ms, the timeout is estimated from each slave response times
+#define BUS_TIMEOUT_RESPONSE_MIN 5
+// How many ms, over the frame transfer time, we will wait for a frame to be sent
+#define BUS_TIMEOUT_TX_DONE 5
+// How many ms the slaves are given to process a broadcast before the next request, the Modbus serial
+// line spec suggests 100 to 200ms, lower it if the slaves on the bus are known to be faster
+#define BUS_DELAY_BROADCAST_TURNAROUND 100
 // How many ms we will wait until we start the bus after configured
 #define BUS_START_DELAY 300
+// Consecutive timeouts until a slave is considered offline
+#define BUS_SLAVE_OFFLINE_TIMEOUTS 3
+// Interval in ms between probes of an offline slave, doubles on each failed probe up to the max
+#define BUS_SLAVE_BACKOFF_MIN 500
+#define BUS_SLAVE_BACKOFF_MAX 30000
+// Max extra attempts of a command the host may configure
+#define BUS_RETRY_MAX 5
+// Max delay in ms before a retry, the doubled backoff stops growing here
+#define BUS_RETRY_BACKOFF_MAX 1000
+// Max commands moved from the command queue to look ahead of the command being processed
+#define BUS_PENDING_COMMANDS 16
+// Max commands processed in a row while a periodic read is due, 0 to always drain the command queue first
+#define BUS_COMMAND_MAX_BURST 8
 // #define BUS_DEBUG_MODBUS_TX_FRAME
 // #define BUS_DEBUG_MODBUS_RX_FRAME
 // #define BUS_DEBUG_PERIODIC_READS
@@ -35,6 +56,7 @@
 
 #define HOST_UART hw_uart1
 #define HOST_QUEUE_LENGTH 200
+#define HOST_MESSAGE_QUEUE_LENGTH 16
 #define HOST_HEARTBEAT_INTERVAL 1000
 // #define HOST_DEBUG_MIN_FRAME
 
@@ -6,12 +6,27 @@
 
 #include "config.h"
 
+//
+// Data Structures
+//
+
+/**
+ * A variable length message to the host, heap allocated and freed by the host task once sent.
+ */
+struct host_message
+{
+    uint8_t type; // MIN id
+    uint8_t size; // payload[] size
+    uint8_t payload[];
+};
+
 //
 // Variables
 //
 
 extern QueueHandle_t host_change_queue;
 extern QueueHandle_t host_command_queue;
+extern QueueHandle_t host_message_queue; // Of struct host_message pointers
 
 //
 // Prototypes
@@ -19,4 +34,16 @@ extern QueueHandle_t host_command_queue;
 
 void host_init(void);
 
+/**
+ * Allocate a message to the host with a payload of size bytes.
+ * @return NULL if size is over the MIN payload limit or there is no memory.
+ */
+struct host_message *host_message_new(uint8_t type, size_t size);
+
+/**
+ * Queue a message to be sent to the host, taking its ownership.
+ * @return false if the queue is full, the message is freed.
+ */
+bool host_message_send(struct host_message *message);
+
 #endif // HOST_H_
\ No newline at end of file
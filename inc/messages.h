@@ -14,24 +14,77 @@ enum message_types
     MESSAGE_CONFIG_BUS_REPLY = /*      */ 0x2,
 
     MESSAGE_PERIODIC_READ_REPLY = /*   */ 0x4, // When a change is detected in a periodic read
+    MESSAGE_SLAVE_STATUS = /*          */ 0x5, // When a slave goes offline or back online
+    MESSAGE_PERIODIC_VALUE_REPLY = /*  */ 0x6, // When a change is detected in a periodic read wider than 16 bits
 
     MESSAGE_COMMAND_READ = /*          */ 0x8,
     MESSAGE_COMMAND_READ_REPLY = /*    */ 0x9,
     MESSAGE_COMMAND_WRITE = /*         */ 0xA,
     MESSAGE_COMMAND_WRITE_REPLY = /*   */ 0xB,
     MESSAGE_DMX_WRITE = /*             */ 0xC,
+    MESSAGE_COMMAND_CANCEL = /*        */ 0xD, // Drop a queued command by seq
+
+    MESSAGE_BLOCK_READ = /*            */ 0x10, // Read consecutive coils/registers
+    MESSAGE_BLOCK_READ_REPLY = /*      */ 0x11,
+    MESSAGE_BLOCK_WRITE = /*           */ 0x12, // Write consecutive coils/registers
+    MESSAGE_BLOCK_WRITE_REPLY = /*     */ 0x13,
+    MESSAGE_COMMAND_MASK_WRITE = /*    */ 0x14, // Modify bits of a register, FC 0x16
+    MESSAGE_COMMAND_MASK_WRITE_REPLY = 0x15,    // Uses write_reply
+    MESSAGE_COMMAND_READ_WRITE = /*    */ 0x16, // Write a register then read one, FC 0x17
+    MESSAGE_COMMAND_READ_WRITE_REPLY = 0x17,    // Uses read_reply
+    MESSAGE_COMMAND_BROADCAST = /*     */ 0x18, // Write to every slave of the bus, uses write
+    MESSAGE_COMMAND_BROADCAST_REPLY = 0x19,     // Uses write_reply, done once sent
+    MESSAGE_RAW = /*                   */ 0x1A, // Host built PDU, sent as is
+    MESSAGE_RAW_REPLY = /*             */ 0x1B,
 
     MESSAGE_PICO_READY = /*            */ 0x3D,
     MESSAGE_PICO_RESET = /*            */ 0x3E,
     MESSAGE_HEARTBEAT = /*             */ 0x3F,
 };
 
+//
+// Outcome of a command, sent in its reply
+enum command_status
+{
+    COMMAND_STATUS_OK = /*             */ 0x0,
+    COMMAND_STATUS_FAILED = /*         */ 0x1, // Run, but the slave didn't acknowledge it
+    COMMAND_STATUS_EXPIRED = /*        */ 0x2, // Not run, its ttl ran out while queued
+    COMMAND_STATUS_CANCELLED = /*      */ 0x3, // Not run, cancelled by the host
+};
+
 //
 // Handler definition
 struct m_handler
 {
     uint8_t message_id;
-    void (*handler)(const void *);
+    void (*handler)(const void *, uint8_t); // Payload and its size, only variable-length messages need it
+};
+
+// Value type of a periodic read. Wider types span consecutive registers, read in the same transaction
+// and reported as a single change. Coils are always PERIODIC_READ_TYPE_UINT16.
+enum periodic_read_type
+{
+    PERIODIC_READ_TYPE_UINT16 = /*     */ 0x0, // Single register, or up to 16 coils
+    PERIODIC_READ_TYPE_INT16 = /*      */ 0x1,
+    PERIODIC_READ_TYPE_UINT32 = /*     */ 0x2, // 2 registers
+    PERIODIC_READ_TYPE_INT32 = /*      */ 0x3,
+    PERIODIC_READ_TYPE_FLOAT32 = /*    */ 0x4, // IEEE 754 single precision
+    PERIODIC_READ_TYPE_UINT64 = /*     */ 0x5, // 4 registers, also any array of 4 registers
+    PERIODIC_READ_TYPE_INT64 = /*      */ 0x6,
+    PERIODIC_READ_TYPE_FLOAT64 = /*    */ 0x7, // IEEE 754 double precision
+};
+
+// Flag on a periodic read type, the least significant register comes first on the bus
+#define PERIODIC_READ_WORD_SWAP 0x80
+
+// Change filter of a periodic read, against the last value reported to the host. Changes that don't
+// pass it are not reported, but still update the periodic reads cache.
+enum periodic_filter
+{
+    PERIODIC_FILTER_NONE = /*          */ 0x0, // Any change
+    PERIODIC_FILTER_MASK = /*          */ 0x1, // Changes of the filter_value bits, of the least significant register
+    PERIODIC_FILTER_ABSOLUTE = /*      */ 0x2, // Changes larger than filter_value, in hundredths for floats
+    PERIODIC_FILTER_PERCENT = /*       */ 0x3, // Changes larger than filter_value hundredths of % of the reported value
 };
 
 // *** Structs have fields order to optimize alignment by hand, but they are packed ***
@@ -46,15 +99,32 @@ struct m_device
     uint16_t address; // Modbus first address to process
 } __attribute__((packed));
 
+//
+// Periodic read of a Bus
+struct m_periodic_read
+{
+    uint16_t interval;      // The interval between reads, 0 to use the bus periodic_interval
+    uint16_t filter_value;  // Bit mask or deadband of the filter
+    uint8_t type;           // enum periodic_read_type, optionally with PERIODIC_READ_WORD_SWAP
+    uint8_t filter;         // enum periodic_filter
+    struct m_device device; // Device to read
+} __attribute__((packed));
+
 //
 // Configure call to enable a Bus
 struct m_config_bus
 {
     uint32_t baudrate;             // Bus baudrate
-    uint16_t periodic_interval;    // The interval between periodic reads
+    uint16_t periodic_interval;    // The default interval between periodic reads
     uint8_t bus;                   // From 0 to 5
+    uint8_t periodic_max_gap;      // Max unused registers/coils between periodic reads grouped in one transaction
+    uint16_t burst_interval;       // Faster interval of periodic reads after a change, 0 disables it
+    uint16_t burst_window;         // How long the burst interval lasts after the last change
+    bool burst_slave;              // If a change bursts the whole slave, instead of only the changed reads
+    uint8_t retry_max;             // Extra attempts of a command after a timeout or a corrupted reply
+    uint16_t retry_backoff;        // Delay in ms before the first retry, doubled on each retry
     uint8_t periodic_reads_length; // periodic_reads[] array size
-    struct m_device periodic_reads[];
+    struct m_periodic_read periodic_reads[];
 } __attribute__((packed));
 
 //
@@ -87,38 +157,150 @@ struct m_command
         } __attribute__((packed)) periodic_change;
         struct
         {
-            uint8_t _dummy;
+            uint64_t data; // Whole value, most significant register first whatever the order on the bus
+            uint8_t type;  // enum periodic_read_type, with PERIODIC_READ_WORD_SWAP as configured
+        } __attribute__((packed)) periodic_value;
+        struct
+        {
+            bool online; // If the slave is answering
+        } __attribute__((packed)) slave_status;
+        struct
+        {
+            uint16_t max_age; // Max age in ms of a cached periodic read to answer with, 0 to always read the bus
+            uint16_t ttl;     // Time in ms the command may wait queued, 0 to never expire
         } __attribute__((packed)) read;
         struct
         {
-            bool done;     // If it was successful
-            uint16_t data; // Data as 16 bits representation
+            bool done;       // If it was successful
+            uint16_t data;   // Data as 16 bits representation
+            uint8_t status;  // enum command_status
+            uint8_t retries; // Attempts after the first one
         } __attribute__((packed)) read_reply;
         struct
         {
             uint16_t data; // Data to write
+            uint16_t ttl;  // Time in ms the command may wait queued, 0 to never expire
         } __attribute__((packed)) write;
         struct
         {
-            bool done;     // If it was successful
-            uint16_t data; // Data as 16 bits representation
+            bool done;       // If it was successful
+            uint16_t data;   // Data as 16 bits representation
+            uint8_t status;  // enum command_status
+            uint8_t retries; // Attempts after the first one
         } __attribute__((packed)) write_reply;
         struct
+        {
+            uint8_t seq; // Seq of the command to cancel, on the bus in device
+        } __attribute__((packed)) cancel;
+        struct
+        {
+            // The register at device.address becomes (current AND and_mask) OR (or_mask AND NOT and_mask)
+            uint16_t and_mask;
+            uint16_t or_mask;
+            uint16_t ttl; // Time in ms the command may wait queued, 0 to never expire
+        } __attribute__((packed)) mask_write;
+        struct
+        {
+            // Writes data to write_address, then reads the register at device.address
+            uint16_t write_address;
+            uint16_t data;
+            uint16_t ttl; // Time in ms the command may wait queued, 0 to never expire
+        } __attribute__((packed)) read_write;
+        struct
         {
             uint8_t _dummy;
         } __attribute__((packed)) timeout;
     } __attribute__((packed)) msg;
 } __attribute__((packed));
 
+//
+// Block commands, variable length, read or write up to M_BLOCK_DATA_SIZE bytes of consecutive coils/registers
+// Data is as in the Modbus PDU: registers big endian, coils packed LSB first.
+// The seq is shared with m_command, so a block command can be cancelled with MESSAGE_COMMAND_CANCEL.
+
+// What is left of a 255 bytes MIN payload after the block header
+#define M_BLOCK_DATA_SIZE 244
+
+struct m_block_read
+{
+    uint8_t seq;
+    struct m_device device; // Function 0x01 to 0x04, address of the first coil/input/register
+    uint16_t quantity;      // Coils/registers to read
+    uint16_t ttl;           // Time in ms the command may wait queued, 0 to never expire
+} __attribute__((packed));
+
+struct m_block_read_reply
+{
+    uint8_t seq;
+    struct m_device device;
+    uint8_t status;    // enum command_status
+    uint8_t retries;   // Attempts after the first one
+    uint16_t quantity; // Coils/registers requested
+    uint8_t data_size; // data[] size, 0 if not done
+    uint8_t data[];
+} __attribute__((packed));
+
+struct m_block_write
+{
+    uint8_t seq;
+    struct m_device device; // Function 0x0F or 0x10, address of the first coil/register
+    uint16_t quantity;      // Coils/registers to write
+    uint16_t ttl;           // Time in ms the command may wait queued, 0 to never expire
+    uint8_t data_size;      // data[] size
+    uint8_t data[];
+} __attribute__((packed));
+
+struct m_block_write_reply
+{
+    uint8_t seq;
+    struct m_device device;
+    uint8_t status;    // enum command_status
+    uint8_t retries;   // Attempts after the first one
+    uint16_t quantity; // Coils/registers requested
+} __attribute__((packed));
+
+//
+// Raw passthrough, variable length, the host builds the PDU and the gateway adds the slave address and CRC.
+// The reply carries the response PDU as received, an exception response included.
+// The seq is shared with m_command, so a raw command can be cancelled with MESSAGE_COMMAND_CANCEL.
+
+// What is left of a 255 bytes MIN payload after the raw header
+#define M_RAW_PDU_SIZE 248
+
+struct m_raw
+{
+    uint8_t seq;
+    uint8_t bus;           // From 0 to 5
+    uint8_t slave;         // Modbus Slave address, 0 to broadcast
+    uint16_t ttl;          // Time in ms the command may wait queued, 0 to never expire
+    uint8_t response_size; // Expected response PDU size, 0 to take the response up to the bus silence
+    uint8_t pdu_size;      // pdu[] size
+    uint8_t pdu[];
+} __attribute__((packed));
+
+struct m_raw_reply
+{
+    uint8_t seq;
+    uint8_t bus;
+    uint8_t slave;
+    uint8_t status;   // enum command_status
+    uint8_t result;   // enum modbus_result of the transaction, MODBUS_INCOMPLETE if it was not run
+    uint8_t pdu_size; // pdu[] size, 0 if not done
+    uint8_t pdu[];
+} __attribute__((packed));
+
 //
 // Message Handlers
-void handle_m_config_bus(const struct m_config_bus *msg);
-void handle_m_command(const struct m_command *msg);
-void handle_m_pico_reset(const uint8_t *msg);
-void handle_m_dmx_write(const struct m_dmx_write *msg);
+void handle_m_config_bus(const struct m_config_bus *msg, uint8_t len);
+void handle_m_command(const struct m_command *msg, uint8_t len);
+void handle_m_pico_reset(const uint8_t *msg, uint8_t len);
+void handle_m_dmx_write(const struct m_dmx_write *msg, uint8_t len);
+void handle_m_block_read(const struct m_block_read *msg, uint8_t len);
+void handle_m_block_write(const struct m_block_write *msg, uint8_t len);
+void handle_m_raw(const struct m_raw *msg, uint8_t len);
 
 //
 // Message handlers array
-extern const struct m_handler m_handlers[5];
+extern const struct m_handler m_handlers[12];
 
 #endif // MESSAGES_H_
\ No newline at end of file
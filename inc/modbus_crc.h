@@ -0,0 +1,59 @@
+#ifndef MODBUS_CRC_H_
+#define MODBUS_CRC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Modbus RTU CRC16.
+// Uses polynomial 0xA001 and initial value 0xFFFF.
+// Tables are built in SRAM by modbus_crc_init, so lookups don't miss the XIP cache.
+//
+
+// Back ends of modbus_crc_update, MODBUS_CRC_ENGINE picks one
+#define MODBUS_CRC_ENGINE_TABLE 0  // Byte-wise lookup in a single table
+#define MODBUS_CRC_ENGINE_SLICE4 1 // 4 bytes per step, 4 tables
+#define MODBUS_CRC_ENGINE_INTERP 2 // Byte-wise, table address from the core interpolator 1
+
+#ifndef MODBUS_CRC_ENGINE
+#define MODBUS_CRC_ENGINE MODBUS_CRC_ENGINE_SLICE4
+#endif
+
+// Slice-by-4 tables, modbus_crc_table[0] is the byte-wise table
+extern uint16_t modbus_crc_table[4][256];
+
+//
+// Prototypes
+//
+
+void modbus_crc_init(void);
+uint16_t modbus_crc_update_table(uint16_t crc, const uint8_t *data, size_t length);
+uint16_t modbus_crc_update_slice4(uint16_t crc, const uint8_t *data, size_t length);
+uint16_t modbus_crc_update_interp(uint16_t crc, const uint8_t *data, size_t length);
+void modbus_crc_benchmark(void);
+
+// Update CRC over a span of data, with the configured back end
+static inline uint16_t modbus_crc_update(uint16_t crc, const uint8_t *data, size_t length)
+{
+#if MODBUS_CRC_ENGINE == MODBUS_CRC_ENGINE_INTERP
+    return modbus_crc_update_interp(crc, data, length);
+#elif MODBUS_CRC_ENGINE == MODBUS_CRC_ENGINE_SLICE4
+    return modbus_crc_update_slice4(crc, data, length);
+#else
+    return modbus_crc_update_table(crc, data, length);
+#endif
+}
+
+// Update CRC with a single byte
+static inline void update_crc(uint16_t *crc, uint8_t byte)
+{
+    *crc = (*crc >> 8) ^ modbus_crc_table[0][(*crc ^ byte) & 0xFF];
+}
+
+// Compute CRC for a buffer of data
+static inline uint16_t compute_crc(const uint8_t *data, size_t length)
+{
+    return modbus_crc_update(0xFFFF, data, length);
+}
+
+#endif // MODBUS_CRC_H_
@@ -7,6 +7,9 @@
 #include "modbus.h"
 #include "macrologger.h"
 
+// Size of a read request frame: slave, function, start (2), quantity (2), CRC (2)
+#define MODBUS_READ_REQUEST_SIZE 8
+
 // Creates a Read Coils (function 0x01) frame.
 // Frame: [slave][0x01][startHi][startLo][quantityHi][quantityLo][CRClo][CRChi]
 // Returns the frame length, or 0 if frameSize is too small.
@@ -37,6 +40,35 @@ static inline size_t modbus_create_read_coils_frame(uint8_t slave_address,
     return total_len;
 }
 
+// Creates a Read Discrete Inputs (function 0x02) frame.
+// Frame: [slave][0x02][startHi][startLo][quantityHi][quantityLo][CRClo][CRChi]
+static inline size_t modbus_create_read_discrete_inputs_frame(uint8_t slave_address,
+                                                              uint16_t start_address,
+                                                              uint16_t quantity,
+                                                              uint8_t *frame,
+                                                              size_t frame_size)
+{
+    const size_t data_len = 6;
+    const size_t total_len = data_len + 2;
+
+    if (frame_size < total_len)
+        return 0;
+
+    size_t pos = 0;
+    frame[pos++] = slave_address;
+    frame[pos++] = 0x02;
+    frame[pos++] = (uint8_t)(start_address >> 8);
+    frame[pos++] = (uint8_t)(start_address & 0xFF);
+    frame[pos++] = (uint8_t)(quantity >> 8);
+    frame[pos++] = (uint8_t)(quantity & 0xFF);
+
+    uint16_t crc = compute_crc(frame, data_len);
+    frame[pos++] = (uint8_t)(crc & 0xFF);
+    frame[pos++] = (uint8_t)((crc >> 8) & 0xFF);
+
+    return total_len;
+}
+
 // Creates a Read Holding Registers (function 0x03) frame.
 // Frame: [slave][0x03][startHi][startLo][quantityHi][quantityLo][CRClo][CRChi]
 static inline size_t modbus_create_read_holding_registers_frame(uint8_t slave_address,
@@ -66,6 +98,35 @@ static inline size_t modbus_create_read_holding_registers_frame(uint8_t slave_ad
     return total_len;
 }
 
+// Creates a Read Input Registers (function 0x04) frame.
+// Frame: [slave][0x04][startHi][startLo][quantityHi][quantityLo][CRClo][CRChi]
+static inline size_t modbus_create_read_input_registers_frame(uint8_t slave_address,
+                                                              uint16_t start_address,
+                                                              uint16_t quantity,
+                                                              uint8_t *frame,
+                                                              size_t frame_size)
+{
+    const size_t data_len = 6;
+    const size_t total_len = data_len + 2;
+
+    if (frame_size < total_len)
+        return 0;
+
+    size_t pos = 0;
+    frame[pos++] = slave_address;
+    frame[pos++] = 0x04;
+    frame[pos++] = (uint8_t)(start_address >> 8);
+    frame[pos++] = (uint8_t)(start_address & 0xFF);
+    frame[pos++] = (uint8_t)(quantity >> 8);
+    frame[pos++] = (uint8_t)(quantity & 0xFF);
+
+    uint16_t crc = compute_crc(frame, data_len);
+    frame[pos++] = (uint8_t)(crc & 0xFF);
+    frame[pos++] = (uint8_t)((crc >> 8) & 0xFF);
+
+    return total_len;
+}
+
 // Creates a Write Single Coil (function 0x05) frame.
 // 'on' true writes 0xFF00 (ON), false writes 0x0000 (OFF).
 // Frame: [slave][0x05][coilAddrHi][coilAddrLo][valueHi][valueLo][CRClo][CRChi]
@@ -99,6 +160,49 @@ static inline size_t modbus_create_write_single_coil_frame(uint8_t slave_address
     return total_len;
 }
 
+// Creates a Write Multiple Coils (function 0x0F) frame.
+// 'coils' is packed as in the request, LSB of the first byte is the coil at 'start_address'.
+// Frame: [slave][0x0F][startHi][startLo][quantityHi][quantityLo][byteCount][coils]... [CRClo][CRChi]
+static inline size_t modbus_create_write_multiple_coils_frame(uint8_t slave_address,
+                                                              uint16_t start_address,
+                                                              const uint8_t *coils,
+                                                              size_t quantity,
+                                                              uint8_t *frame,
+                                                              size_t frame_size)
+{
+    if (quantity == 0 || quantity > MODBUS_MAX_WRITE_COILS)
+        return 0;
+
+    // Fixed bytes: slave (1) + function (1) + start (2) + quantity (2) + byteCount (1)
+    // Coils: 1 bit each, plus 2 bytes for CRC.
+    const size_t byte_count = bits_to_bytes(quantity);
+    const size_t data_len = 1 + 1 + 2 + 2 + 1 + byte_count;
+    const size_t total_len = data_len + 2;
+
+    if (frame_size < total_len)
+        return 0;
+
+    size_t pos = 0;
+    frame[pos++] = slave_address;
+    frame[pos++] = 0x0F;
+    frame[pos++] = (uint8_t)(start_address >> 8);
+    frame[pos++] = (uint8_t)(start_address & 0xFF);
+    frame[pos++] = (uint8_t)(quantity >> 8);
+    frame[pos++] = (uint8_t)(quantity & 0xFF);
+    frame[pos++] = (uint8_t)byte_count;
+
+    for (size_t i = 0; i < byte_count; ++i)
+    {
+        frame[pos++] = coils[i];
+    }
+
+    uint16_t crc = compute_crc(frame, data_len);
+    frame[pos++] = (uint8_t)(crc & 0xFF);
+    frame[pos++] = (uint8_t)((crc >> 8) & 0xFF);
+
+    return total_len;
+}
+
 // Creates a Write Multiple Registers (function 0x10) frame.
 // 'registers' is an array of register values and 'quantity' is the number of registers.
 // Frame: [slave][0x10][startHi][startLo][quantityHi][quantityLo][byteCount][reg1Hi][reg1Lo]... [CRClo][CRChi]
@@ -109,7 +213,7 @@ static inline size_t modbus_create_write_multiple_registers_frame(uint8_t slave_
                                                                   uint8_t *frame,
                                                                   size_t frame_size)
 {
-    if (quantity == 0 || quantity > 123)
+    if (quantity == 0 || quantity > MODBUS_MAX_WRITE_REGISTERS)
         return 0;
 
     // Fixed bytes: slave (1) + function (1) + start (2) + quantity (2) + byteCount (1)
@@ -143,8 +247,104 @@ static inline size_t modbus_create_write_multiple_registers_frame(uint8_t slave_
     return total_len;
 }
 
+
+// Creates a Mask Write Register (function 0x16) frame.
+// The slave writes (current AND and_mask) OR (or_mask AND NOT and_mask) to the register.
+// Frame: [slave][0x16][addrHi][addrLo][andHi][andLo][orHi][orLo][CRClo][CRChi]
+static inline size_t modbus_create_mask_write_register_frame(uint8_t slave_address,
+                                                             uint16_t register_address,
+                                                             uint16_t and_mask,
+                                                             uint16_t or_mask,
+                                                             uint8_t *frame,
+                                                             size_t frame_size)
+{
+    const size_t data_len = 8;
+    const size_t total_len = data_len + 2;
+
+    if (frame_size < total_len)
+        return 0;
+
+    frame[0] = slave_address;
+    frame[1] = 0x16;
+    frame[2] = (uint8_t)(register_address >> 8);
+    frame[3] = (uint8_t)(register_address & 0xFF);
+    frame[4] = (uint8_t)(and_mask >> 8);
+    frame[5] = (uint8_t)(and_mask & 0xFF);
+    frame[6] = (uint8_t)(or_mask >> 8);
+    frame[7] = (uint8_t)(or_mask & 0xFF);
+
+    uint16_t crc = compute_crc(frame, data_len);
+    frame[8] = (uint8_t)(crc & 0xFF);
+    frame[9] = (uint8_t)((crc >> 8) & 0xFF);
+
+    return total_len;
+}
+
+// Creates a Read/Write Multiple Registers (function 0x17) frame.
+// The slave performs the write before the read, so the read can return the written registers.
+// Frame: [slave][0x17][readHi][readLo][readQtyHi][readQtyLo][writeHi][writeLo][writeQtyHi][writeQtyLo]
+//        [byteCount][reg1Hi][reg1Lo]... [CRClo][CRChi]
+static inline size_t modbus_create_read_write_multiple_registers_frame(uint8_t slave_address,
+                                                                       uint16_t read_address,
+                                                                       uint16_t read_quantity,
+                                                                       uint16_t write_address,
+                                                                       const uint16_t *registers,
+                                                                       size_t write_quantity,
+                                                                       uint8_t *frame,
+                                                                       size_t frame_size)
+{
+    if (read_quantity == 0 || read_quantity > MODBUS_MAX_READ_WRITE_READ_REGISTERS ||
+        write_quantity == 0 || write_quantity > MODBUS_MAX_READ_WRITE_WRITE_REGISTERS)
+        return 0;
+
+    // Fixed bytes: slave (1) + function (1) + read start (2) + read quantity (2) + write start (2)
+    // + write quantity (2) + byteCount (1). Each register: 2 bytes, plus 2 bytes for CRC.
+    const size_t data_len = 1 + 1 + 2 + 2 + 2 + 2 + 1 + (write_quantity * 2);
+    const size_t total_len = data_len + 2;
+
+    if (frame_size < total_len)
+        return 0;
+
+    size_t pos = 0;
+    frame[pos++] = slave_address;
+    frame[pos++] = 0x17;
+    frame[pos++] = (uint8_t)(read_address >> 8);
+    frame[pos++] = (uint8_t)(read_address & 0xFF);
+    frame[pos++] = (uint8_t)(read_quantity >> 8);
+    frame[pos++] = (uint8_t)(read_quantity & 0xFF);
+    frame[pos++] = (uint8_t)(write_address >> 8);
+    frame[pos++] = (uint8_t)(write_address & 0xFF);
+    frame[pos++] = (uint8_t)(write_quantity >> 8);
+    frame[pos++] = (uint8_t)(write_quantity & 0xFF);
+    frame[pos++] = (uint8_t)(write_quantity * 2);
+
+    for (size_t i = 0; i < write_quantity; ++i)
+    {
+        frame[pos++] = (uint8_t)(registers[i] >> 8);
+        frame[pos++] = (uint8_t)(registers[i] & 0xFF);
+    }
+
+    uint16_t crc = compute_crc(frame, data_len);
+    frame[pos++] = (uint8_t)(crc & 0xFF);
+    frame[pos++] = (uint8_t)((crc >> 8) & 0xFF);
+
+    return total_len;
+}
+//
+// Coil reads pack the first coil and the number of coils(1 to 16) in a single 16 bits address
+static inline uint16_t modbus_coil_address(uint16_t address)
+{
+    return address / 16;
+}
+
+static inline uint16_t modbus_coil_quantity(uint16_t address)
+{
+    return address % 16 + 1;
+}
+
 //
-// Create a Read Coils or Holding Registers frame based on parameters(Will only read 16 bits at a time)
+// Create a Read Coils/Discrete Inputs or Holding/Input Registers frame based on parameters(Will only read 16 bits at a time)
+// Discrete inputs pack their address as coils.
 static inline size_t modbus_create_read_frame(enum modbus_function function,
                                               uint8_t slave_address,
                                               uint16_t start_address,
@@ -153,14 +353,76 @@ static inline size_t modbus_create_read_frame(enum modbus_function function,
 {
     if (function == MODBUS_FUNCTION_READ_COILS)
     {
-        uint8_t addr = start_address / 16;
-        uint8_t len = start_address % 16 + 1;
+        uint16_t addr = modbus_coil_address(start_address);
+        uint16_t len = modbus_coil_quantity(start_address);
         return modbus_create_read_coils_frame(slave_address, addr, len, frame, frame_size);
     }
+    else if (function == MODBUS_FUNCTION_READ_DISCRETE_INPUTS)
+    {
+        uint16_t addr = modbus_coil_address(start_address);
+        uint16_t len = modbus_coil_quantity(start_address);
+        return modbus_create_read_discrete_inputs_frame(slave_address, addr, len, frame, frame_size);
+    }
     else if (function == MODBUS_FUNCTION_READ_HOLDING_REGISTERS)
     {
         return modbus_create_read_holding_registers_frame(slave_address, start_address, 1, frame, frame_size);
     }
+    else if (function == MODBUS_FUNCTION_READ_INPUT_REGISTERS)
+    {
+        return modbus_create_read_input_registers_frame(slave_address, start_address, 1, frame, frame_size);
+    }
+    else
+    {
+        LOG_ERROR("Invalid Modbus function %u", function);
+        return 0;
+    }
+}
+
+//
+// Value of a reply to modbus_create_read_frame, the same 16 bits representation as periodic reads.
+// Coils go first byte on the high byte, a reply for up to 8 coils only has the high byte.
+// Returns false if the reply data is not the size the request asked for.
+static inline bool modbus_read_frame_value(enum modbus_function function,
+                                           uint16_t start_address,
+                                           const uint8_t *data,
+                                           size_t data_size,
+                                           uint16_t *value)
+{
+    size_t expected_size = 2;
+    if (modbus_function_reads_bits(function))
+        expected_size = modbus_function_return_size(function, modbus_coil_quantity(start_address));
+    if (data_size != expected_size)
+        return false;
+
+    *value = data[0] << 8 | (data_size >= 2 ? data[1] : 0);
+    return true;
+}
+
+//
+// Create a Read Coils/Discrete Inputs or Holding/Input Registers frame for a range of coils/registers
+static inline size_t modbus_create_read_range_frame(enum modbus_function function,
+                                                    uint8_t slave_address,
+                                                    uint16_t start_address,
+                                                    uint16_t quantity,
+                                                    uint8_t *frame,
+                                                    size_t frame_size)
+{
+    if (function == MODBUS_FUNCTION_READ_COILS)
+    {
+        return modbus_create_read_coils_frame(slave_address, start_address, quantity, frame, frame_size);
+    }
+    else if (function == MODBUS_FUNCTION_READ_DISCRETE_INPUTS)
+    {
+        return modbus_create_read_discrete_inputs_frame(slave_address, start_address, quantity, frame, frame_size);
+    }
+    else if (function == MODBUS_FUNCTION_READ_HOLDING_REGISTERS)
+    {
+        return modbus_create_read_holding_registers_frame(slave_address, start_address, quantity, frame, frame_size);
+    }
+    else if (function == MODBUS_FUNCTION_READ_INPUT_REGISTERS)
+    {
+        return modbus_create_read_input_registers_frame(slave_address, start_address, quantity, frame, frame_size);
+    }
     else
     {
         LOG_ERROR("Invalid Modbus function %u", function);
@@ -192,4 +454,37 @@ static inline size_t modbus_create_write_frame(enum modbus_function function,
     }
 }
 
+//
+// Expected response size of a request frame, 0 if unknown
+static inline size_t modbus_expected_response_size(const uint8_t *frame, size_t frame_size)
+{
+    if (frame_size < 6)
+        return 0;
+
+    uint16_t quantity = (uint16_t)(frame[4] << 8 | frame[5]);
+    switch (frame[1])
+    {
+    case MODBUS_FUNCTION_READ_COILS:
+    case MODBUS_FUNCTION_READ_DISCRETE_INPUTS:
+        // slave, function, byteCount, coils, CRC (2)
+        return 3 + bits_to_bytes(quantity) + 2;
+    case MODBUS_FUNCTION_READ_HOLDING_REGISTERS:
+    case MODBUS_FUNCTION_READ_INPUT_REGISTERS:
+    case MODBUS_FUNCTION_READ_WRITE_REGISTERS: // Read quantity is at the same place
+        // slave, function, byteCount, registers, CRC (2)
+        return 3 + quantity * 2 + 2;
+    case MODBUS_FUNCTION_WRITE_SINGLE_COIL:
+    case 0x06: // Write Single Register
+    case MODBUS_FUNCTION_WRITE_COILS:
+    case MODBUS_FUNCTION_WRITE_HOLDING_REGISTERS:
+        // slave, function, address (2), value or quantity (2), CRC (2)
+        return 8;
+    case MODBUS_FUNCTION_MASK_WRITE_REGISTER:
+        // slave, function, address (2), and mask (2), or mask (2), CRC (2)
+        return 10;
+    default:
+        return 0;
+    }
+}
+
 #endif // MODBUS_FRAMER_H
\ No newline at end of file
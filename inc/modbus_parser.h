@@ -3,15 +3,18 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
 #include "modbus.h"
 
 // Frame structure to store Modbus frame data
+// data points into the parser buffer, valid until the buffer is reused.
 struct modbus_frame
 {
     uint8_t slave;
     uint8_t function_code;
-    uint8_t address;
-    uint8_t data[8];
+    uint16_t address;
+    const uint8_t *data;
     uint8_t data_size;
     uint16_t crc;
 };
@@ -39,6 +42,8 @@ enum modbus_result
     MODBUS_ERROR_FUNCTION = 3,
     MODBUS_ERROR_EXCEPTION = 4,
     MODBUS_ERROR_CRC = 5,
+    MODBUS_ERROR_TIMEOUT = 6,
+    MODBUS_ERROR_LENGTH = 7,
 };
 
 // Parser context structure
@@ -47,12 +52,27 @@ struct modbus_parser
     enum modbus_parser_state state;
     uint16_t crc;
     size_t data_length;
+    size_t frame_len;  // Bytes of the frame parsed so far
+    size_t data_start; // Position of the first data byte in the frame
+    // Caller provided buffer, the frame being parsed starts at buffer[0]
+    uint8_t *buffer;
+    size_t capacity;
+    size_t parsed;   // Bytes of buffer parsed, the frame so far
+    size_t received; // Bytes in buffer, parsed or not
+    // Bulk parsing, see modbus_parser_process_buffer
+    uint8_t expected_slave;        // Slave of the frame to hunt for
+    uint8_t expected_function;     // Function of the frame to hunt for, 0 for any
+    size_t expected_size;          // Size of the frame to hunt for, 0 if unknown
+    enum modbus_result last_error; // Last error skipped, MODBUS_INCOMPLETE if none
 };
 
-// Function to add data to frame
-static inline void modbus_frame_add_data(struct modbus_frame *frame, uint8_t byte)
+// Function to add data to frame, data is left in place in the parser buffer
+static inline void modbus_frame_add_data(struct modbus_parser *parser, struct modbus_frame *frame)
 {
-    frame->data[frame->data_size++] = byte;
+    if (frame->data_size++ == 0)
+    {
+        frame->data = parser->buffer + parser->data_start;
+    }
 }
 
 // Reset parser
@@ -61,15 +81,21 @@ static inline void modbus_parser_reset(struct modbus_parser *parser)
     parser->state = WAIT_SLAVE;
     parser->crc = 0xFFFF;
     parser->data_length = 0;
+    parser->frame_len = 0;
 }
 
 static bool is_valid_modbus_function(uint8_t functionCode)
 {
     return (functionCode == 0x01 || // Read Coils
+            functionCode == 0x02 || // Read Discrete Inputs
             functionCode == 0x03 || // Read Holding Registers
+            functionCode == 0x04 || // Read Input Registers
             functionCode == 0x05 || // Write Single Coil
             functionCode == 0x06 || // Write Single Register
-            functionCode == 0x10);  // Write Multiple Registers
+            functionCode == 0x0F || // Write Multiple Coils
+            functionCode == 0x10 || // Write Multiple Registers
+            functionCode == 0x16 || // Mask Write Register
+            functionCode == 0x17);  // Read/Write Multiple Registers
 }
 
 // Process a single byte
@@ -79,6 +105,7 @@ static inline enum modbus_result modbus_parser_process_byte(struct modbus_parser
 {
     enum modbus_result ret = MODBUS_INCOMPLETE;
 
+    parser->frame_len++;
     switch (parser->state)
     {
     case WAIT_SLAVE:
@@ -101,8 +128,12 @@ static inline enum modbus_result modbus_parser_process_byte(struct modbus_parser
         {
             if (is_valid_modbus_function(byte & 0x7F))
             {
-                ret = MODBUS_ERROR_EXCEPTION;
-                modbus_parser_reset(parser);
+                // Exception, the exception code and the CRC follow
+                update_crc(&parser->crc, byte);
+                frame->data_size = 0;
+                parser->data_length = 1;
+                parser->data_start = parser->frame_len;
+                parser->state = WAIT_DATA;
             }
             else
             {
@@ -120,6 +151,7 @@ static inline enum modbus_result modbus_parser_process_byte(struct modbus_parser
             case 0x02:
             case 0x03:
             case 0x04:
+            case 0x17:
                 parser->state = WAIT_LENGTH;
                 break;
 
@@ -127,6 +159,7 @@ static inline enum modbus_result modbus_parser_process_byte(struct modbus_parser
             case 0x06:
             case 0x0F:
             case 0x10:
+            case 0x16:
                 parser->state = WAIT_ADDRESS_1;
                 break;
             }
@@ -135,29 +168,38 @@ static inline enum modbus_result modbus_parser_process_byte(struct modbus_parser
 
     case WAIT_ADDRESS_1:
         update_crc(&parser->crc, byte);
-        frame->address = byte;
+        frame->address = byte << 8;
         parser->state = WAIT_ADDRESS_2;
         break;
 
     case WAIT_ADDRESS_2:
         update_crc(&parser->crc, byte);
-        frame->address |= (byte << 8);
-        parser->data_length = 2;
+        frame->address |= byte;
+        // Mask Write Register echoes both masks, the others a value or a quantity
+        parser->data_length = frame->function_code == 0x16 ? 4 : 2;
+        parser->data_start = parser->frame_len;
         parser->state = WAIT_DATA;
 
         break;
 
     case WAIT_LENGTH:
+        // slave, function, byteCount, data, CRC (2) must fit in the buffer
+        if (byte == 0 || byte + 5u > parser->capacity)
+        {
+            ret = MODBUS_ERROR_LENGTH;
+            modbus_parser_reset(parser);
+            break;
+        }
         update_crc(&parser->crc, byte);
         parser->data_length = byte;
+        parser->data_start = parser->frame_len;
         frame->data_size = 0;
-        memset(frame->data, 0, sizeof(frame->data));
         parser->state = WAIT_DATA;
         break;
 
     case WAIT_DATA:
         update_crc(&parser->crc, byte);
-        modbus_frame_add_data(frame, byte);
+        modbus_frame_add_data(parser, frame);
         if (frame->data_size == parser->data_length)
         {
             parser->state = WAIT_CRC1;
@@ -171,7 +213,10 @@ static inline enum modbus_result modbus_parser_process_byte(struct modbus_parser
 
     case WAIT_CRC2:
         frame->crc |= (byte << 8);
-        ret = (parser->crc == frame->crc) ? MODBUS_COMPLETE : MODBUS_ERROR_CRC;
+        if (parser->crc != frame->crc)
+            ret = MODBUS_ERROR_CRC;
+        else
+            ret = (frame->function_code & 0x80) ? MODBUS_ERROR_EXCEPTION : MODBUS_COMPLETE;
         modbus_parser_reset(parser);
         break;
     }
@@ -179,4 +224,160 @@ static inline enum modbus_result modbus_parser_process_byte(struct modbus_parser
     return ret;
 }
 
+//
+// Bulk parsing
+// Bytes are kept in the caller buffer from the start of the frame being parsed. On an error the buffer
+// slides one byte and is parsed again, so a good frame after line noise or an echoed request is still
+// found. Bytes can be received straight in the buffer, see modbus_parser_reserve.
+//
+
+// Start parsing a frame in 'buffer', the full RTU ADU (MODBUS_ADU_SIZE) for any frame.
+// Frames not from 'slave' with 'function' or its exception are skipped, 'size' is the expected frame
+// size, 0 if unknown.
+static inline void modbus_parser_expect(struct modbus_parser *parser,
+                                        uint8_t *buffer,
+                                        size_t capacity,
+                                        uint8_t slave,
+                                        uint8_t function,
+                                        size_t size)
+{
+    modbus_parser_reset(parser);
+    parser->buffer = buffer;
+    parser->capacity = capacity;
+    parser->parsed = 0;
+    parser->received = 0;
+    parser->expected_slave = slave;
+    parser->expected_function = function;
+    parser->expected_size = size;
+    parser->last_error = MODBUS_INCOMPLETE;
+}
+
+// Take the data bytes already received in a single step, updating the CRC over the whole span.
+// Returns the bytes taken, 0 to parse the next byte with modbus_parser_feed.
+static inline size_t modbus_parser_feed_data(struct modbus_parser *parser, struct modbus_frame *frame)
+{
+    if (parser->state != WAIT_DATA)
+        return 0;
+
+    size_t span = parser->data_length - frame->data_size;
+    if (span > parser->received - parser->parsed)
+        span = parser->received - parser->parsed;
+    // Bytes past the expected size are left to modbus_parser_feed to reject
+    if (parser->expected_size && parser->parsed + span > parser->expected_size)
+        span = parser->parsed < parser->expected_size ? parser->expected_size - parser->parsed : 0;
+    if (span == 0)
+        return 0;
+
+    const uint8_t *data = parser->buffer + parser->parsed;
+    if (frame->data_size == 0)
+        frame->data = data;
+    parser->crc = modbus_crc_update(parser->crc, data, span);
+    frame->data_size += span;
+    parser->frame_len += span;
+    parser->parsed += span;
+    if (frame->data_size == parser->data_length)
+        parser->state = WAIT_CRC1;
+    return span;
+}
+
+// Parse the byte at 'index' of the buffer
+static inline enum modbus_result modbus_parser_feed(struct modbus_parser *parser,
+                                                    struct modbus_frame *frame,
+                                                    size_t index)
+{
+    uint8_t byte = parser->buffer[index];
+    if (index == 0 && byte != parser->expected_slave)
+        return MODBUS_ERROR_SLAVE;
+    if (index == 1 && parser->expected_function && (byte & 0x7F) != parser->expected_function)
+        return MODBUS_ERROR_FUNCTION;
+    if (parser->expected_size && index >= parser->expected_size)
+        return MODBUS_ERROR_LENGTH;
+    return modbus_parser_process_byte(parser, frame, byte);
+}
+
+// Slide the buffer one byte and parse it again, until a frame is found or what is left of the
+// parsed bytes is the start of a frame
+static inline enum modbus_result modbus_parser_resync(struct modbus_parser *parser,
+                                                      struct modbus_frame *frame)
+{
+    while (parser->parsed > 0)
+    {
+        // Received bytes not parsed yet slide too
+        parser->parsed--;
+        parser->received--;
+        memmove(parser->buffer, parser->buffer + 1, parser->received);
+        modbus_parser_reset(parser);
+
+        enum modbus_result ret = MODBUS_INCOMPLETE;
+        for (size_t i = 0; i < parser->parsed && ret == MODBUS_INCOMPLETE; i++)
+        {
+            ret = modbus_parser_feed(parser, frame, i);
+        }
+        if (ret == MODBUS_INCOMPLETE || ret == MODBUS_COMPLETE || ret == MODBUS_ERROR_EXCEPTION)
+        {
+            return ret;
+        }
+        parser->last_error = ret;
+    }
+    modbus_parser_reset(parser);
+    return MODBUS_INCOMPLETE;
+}
+
+// Free space at the end of the buffer, to receive bytes in place before modbus_parser_commit
+static inline uint8_t *modbus_parser_reserve(struct modbus_parser *parser, size_t *room)
+{
+    *room = parser->capacity - parser->received;
+    return parser->buffer + parser->received;
+}
+
+// Parse 'size' bytes received in place, see modbus_parser_reserve.
+// Returns MODBUS_COMPLETE or MODBUS_ERROR_EXCEPTION when the frame is found, MODBUS_INCOMPLETE
+// otherwise. Errors are skipped, the last one is kept in last_error.
+static inline enum modbus_result modbus_parser_commit(struct modbus_parser *parser,
+                                                      struct modbus_frame *frame,
+                                                      size_t size)
+{
+    enum modbus_result ret = MODBUS_INCOMPLETE;
+    parser->received += size;
+    while (ret == MODBUS_INCOMPLETE && parser->parsed < parser->received)
+    {
+        // Data bytes need no decision, take them all at once
+        if (modbus_parser_feed_data(parser, frame) > 0)
+            continue;
+        ret = modbus_parser_feed(parser, frame, parser->parsed++);
+        if (ret >= MODBUS_ERROR_SLAVE && ret != MODBUS_ERROR_EXCEPTION)
+        {
+            parser->last_error = ret;
+            ret = modbus_parser_resync(parser, frame);
+        }
+    }
+    if (ret == MODBUS_INCOMPLETE && parser->received == parser->capacity)
+    {
+        // Longer than any frame the buffer can hold, can't be the start of one
+        parser->last_error = MODBUS_ERROR_LENGTH;
+        ret = modbus_parser_resync(parser, frame);
+    }
+    return ret;
+}
+
+// Process a span of bytes copying them to the buffer, see modbus_parser_commit
+static inline enum modbus_result modbus_parser_process_buffer(struct modbus_parser *parser,
+                                                              struct modbus_frame *frame,
+                                                              const uint8_t *buffer,
+                                                              size_t size)
+{
+    enum modbus_result ret = MODBUS_INCOMPLETE;
+    while (ret == MODBUS_INCOMPLETE && size > 0)
+    {
+        size_t room;
+        uint8_t *dst = modbus_parser_reserve(parser, &room);
+        size_t len = size < room ? size : room;
+        memcpy(dst, buffer, len);
+        buffer += len;
+        size -= len;
+        ret = modbus_parser_commit(parser, frame, len);
+    }
+    return ret;
+}
+
 #endif // MODBUS_RTU_PARSER_H
\ No newline at end of file
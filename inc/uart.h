@@ -31,6 +31,7 @@ struct uart
     SemaphoreHandle_t tx_buffer_mutex; // Mutex to protect the TX Buffer
     volatile bool tx_buffer_overrun;   // If the TX Buffer has overrun
     volatile bool tx_done;             // If the TX has no more data to send
+    SemaphoreHandle_t tx_done_signal;  // Given when the TX has no more data to send
     SemaphoreHandle_t rx_buffer_mutex; // Mutex to protect the RX Buffer
     StreamBufferHandle_t rx_buffer;    // RX Buffer
     volatile bool rx_buffer_overrun;   // If the RX Buffer has overrun
@@ -121,29 +122,42 @@ size_t hw_uart_write_bytes_blocking(struct hw_uart *const uart, const void *src,
  */
 size_t pio_uart_write_bytes_blocking(struct pio_uart *const uart, const void *src, size_t size);
 
+/**
+ * Wait until a PIO UART has sent all data, including the stop bit of the last byte.
+ * @return false if the timeout has expired.
+ */
+bool pio_uart_wait_tx_done(struct pio_uart *const uart, TickType_t timeout);
+
 /**
  * Read bytes from a Hardware UART.
  * @return Number of bytes read. May not be equal to data_length.
  */
-size_t hw_uart_read_bytes(struct hw_uart *const uart, void *dst, uint8_t size);
+size_t hw_uart_read_bytes(struct hw_uart *const uart, void *dst, size_t size);
 
 /**
  * Read bytes from a Hardware UART, waiting for new bytes to arrive if empty.
  * @return Number of bytes read. May not be equal to data_length.
  */
-size_t hw_uart_read_bytes_blocking(struct hw_uart *const uart, void *dst, uint8_t size);
+size_t hw_uart_read_bytes_blocking(struct hw_uart *const uart, void *dst, size_t size);
 
 /**
  * Read bytes from a PIO UART.
  * @return Number of bytes read. May not be equal to data_length.
  */
-size_t pio_uart_read_bytes(struct pio_uart *const uart, void *dst, uint8_t size);
+size_t pio_uart_read_bytes(struct pio_uart *const uart, void *dst, size_t size);
 
 /**
  * Read bytes from a PIO UART, waiting for new bytes to arrive if empty.
  * @return Number of bytes read. May not be equal to data_length.
  */
-size_t pio_uart_read_bytes_blocking(struct pio_uart *const uart, void *dst, uint8_t size);
+size_t pio_uart_read_bytes_blocking(struct pio_uart *const uart, void *dst, size_t size);
+
+/**
+ * Read bytes from a PIO UART, waiting up to timeout ticks for new bytes to arrive if empty.
+ * Returns as soon as any byte is available, with all bytes available up to size.
+ * @return Number of bytes read. May not be equal to data_length.
+ */
+size_t pio_uart_read_bytes_timeout(struct pio_uart *const uart, void *dst, size_t size, TickType_t timeout);
 
 /**
  * Flush the RX of a Hardware UART.
@@ -15,6 +15,8 @@
 // FreeRTOS Tick helper functions
 #define NEXT_TIMEOUT(timeout) (xTaskGetTickCount() + pdMS_TO_TICKS(timeout))
 #define IS_EXPIRED(timeout) (xTaskGetTickCount() >= timeout)
+// Tick comparison that survives the tick counter wrap around
+#define TICK_BEFORE(a, b) ((int32_t)((TickType_t)(a) - (TickType_t)(b)) < 0)
 
 #define FREERTOS_NO_WAIT (0)
 
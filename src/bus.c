@@ -1,92 +1,2335 @@
 
+#include <math.h>
+#include <string.h>
+
 #include <FreeRTOS.h>
 #include <task.h>
+#include <pico/time.h>
+
+#include "macrologger.h"
+
+#include "bus.h"
+#include "host.h"
+#include "utils.h"
+
+char *name[COUNT_PIO_UARTS] = {
+    "Bus 0",
+    "Bus 1",
+    "Bus 2",
+    "Bus 3",
+    "Bus 4",
+};
+
+static struct bus_context *bus_contexts[COUNT_PIO_UARTS] = {NULL};
+
+//
+// Periodic reads grouping
+//
+
+// First register/coil read by a periodic read
+static inline uint16_t periodic_read_address(const struct bus_periodic_read *p_read)
+{
+    if (modbus_function_reads_bits(p_read->function))
+    {
+        return modbus_coil_address(p_read->address);
+    }
+    return p_read->address;
+}
+
+// Registers of a periodic read value
+static inline uint8_t periodic_read_width(const struct bus_periodic_read *p_read)
+{
+    switch (p_read->type & ~PERIODIC_READ_WORD_SWAP)
+    {
+    case PERIODIC_READ_TYPE_UINT32:
+    case PERIODIC_READ_TYPE_INT32:
+    case PERIODIC_READ_TYPE_FLOAT32:
+        return 2;
+    case PERIODIC_READ_TYPE_UINT64:
+    case PERIODIC_READ_TYPE_INT64:
+    case PERIODIC_READ_TYPE_FLOAT64:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+// Bit position in last_data of the register at 'index' from the first register of a periodic read
+static inline uint8_t periodic_read_word_shift(const struct bus_periodic_read *p_read, uint16_t index)
+{
+    if (p_read->type & PERIODIC_READ_WORD_SWAP)
+    {
+        return index * 16;
+    }
+    return (periodic_read_width(p_read) - 1 - index) * 16;
+}
+
+// Number of registers/coils read by a periodic read
+static inline uint16_t periodic_read_quantity(const struct bus_periodic_read *p_read)
+{
+    if (modbus_function_reads_bits(p_read->function))
+    {
+        return modbus_coil_quantity(p_read->address);
+    }
+    return periodic_read_width(p_read);
+}
+
+// Max registers/coils a group can read, limited by the Modbus spec and by our frame buffer
+static inline uint16_t periodic_group_max_quantity(uint8_t function)
+{
+    if (modbus_function_reads_bits(function))
+    {
+        return MIN(MODBUS_MAX_READ_COILS, (BUS_MODBUS_FRAME_BUFFER_SIZE - 5) * 8);
+    }
+    return MIN(MODBUS_MAX_READ_REGISTERS, (BUS_MODBUS_FRAME_BUFFER_SIZE - 5) / 2);
+}
+
+static inline bool periodic_read_less(const struct bus_periodic_read *a, const struct bus_periodic_read *b)
+{
+    if (a->slave != b->slave)
+    {
+        return a->slave < b->slave;
+    }
+    if (a->function != b->function)
+    {
+        return a->function < b->function;
+    }
+    if (a->interval != b->interval)
+    {
+        return a->interval < b->interval;
+    }
+    return periodic_read_address(a) < periodic_read_address(b);
+}
+
+/**
+ * Group periodic reads on the same slave, function and interval with close addresses, so each group
+ * is read in a single Modbus transaction.
+ * Periodic reads are sorted, so each group points to a contiguous slice of periodic_reads[].
+ */
+static void build_periodic_groups(struct bus_context *bus_context)
+{
+    struct bus_periodic_read *reads = bus_context->periodic_reads;
+    size_t reads_len = bus_context->periodic_reads_len;
+
+    // Sort by slave, function and address. Insertion sort, as we have few entries
+    for (size_t i = 1; i < reads_len; i++)
+    {
+        struct bus_periodic_read key = reads[i];
+        size_t j = i;
+        while (j > 0 && periodic_read_less(&key, &reads[j - 1]))
+        {
+            reads[j] = reads[j - 1];
+            j--;
+        }
+        reads[j] = key;
+    }
+
+    bus_context->periodic_groups_len = 0;
+    if (reads_len == 0)
+    {
+        return;
+    }
+    // Worst case, one group per periodic read
+    bus_context->periodic_groups = pvPortCalloc(reads_len, sizeof(struct bus_periodic_group));
+
+    struct bus_periodic_group *group = NULL;
+    for (size_t i = 0; i < reads_len; i++)
+    {
+        struct bus_periodic_read *p_read = &reads[i];
+        uint32_t start = periodic_read_address(p_read);
+        uint32_t end = start + periodic_read_quantity(p_read);
+
+        if (group != NULL &&
+            group->slave == p_read->slave &&
+            group->function == p_read->function &&
+            group->interval == p_read->interval)
+        {
+            uint32_t group_end = group->address + group->quantity;
+            uint32_t new_end = MAX(end, group_end);
+            if (start <= group_end + bus_context->periodic_max_gap &&
+                new_end - group->address <= periodic_group_max_quantity(group->function))
+            {
+                group->quantity = new_end - group->address;
+                group->reads_len++;
+                continue;
+            }
+        }
+
+        group = &bus_context->periodic_groups[bus_context->periodic_groups_len++];
+        group->slave = p_read->slave;
+        group->function = p_read->function;
+        group->address = start;
+        group->quantity = end - start;
+        group->interval = p_read->interval;
+        group->next_run = 0;
+        group->reads_index = i;
+        group->reads_len = 1;
+    }
+
+    for (size_t i = 0; i < bus_context->periodic_groups_len; i++)
+    {
+        group = &bus_context->periodic_groups[i];
+        // The request never changes, build it once
+        group->frame_size = modbus_create_read_range_frame(
+            group->function,
+            group->slave,
+            group->address,
+            group->quantity,
+            group->frame,
+            sizeof(group->frame));
+        if (group->frame_size == 0)
+        {
+            LOG_ERROR(DEVF_FMT "Modbus Frame creation failed",
+                      bus_context->bus, group->slave, group->address, group->function);
+        }
+        LOG_INFO(DEVF_FMT "Periodic Group, Quantity: %u, Reads: %u, Interval: %u",
+                 bus_context->bus, group->slave, group->address, group->function,
+                 group->quantity, group->reads_len, group->interval);
+    }
+}
+
+// Extract the value of a single periodic read from its group reply, as if it was read alone
+static uint64_t periodic_read_extract(const struct bus_periodic_group *group,
+                                      const struct bus_periodic_read *p_read,
+                                      const struct modbus_frame *frame)
+{
+    uint16_t offset = periodic_read_address(p_read) - group->address;
+    if (modbus_function_reads_bits(group->function))
+    {
+        // Coils are packed LSB first, realign them to the first coil of this read
+        uint8_t bytes[2] = {0};
+        for (uint16_t i = 0; i < periodic_read_quantity(p_read); i++)
+        {
+            uint16_t bit = offset + i;
+            if (frame->data[bit / 8] & (1 << (bit % 8)))
+            {
+                bytes[i / 8] |= 1 << (i % 8);
+            }
+        }
+        return bytes[0] << 8 | bytes[1];
+    }
+
+    // All registers of the value come from the same reply, so it is never half updated
+    uint64_t value = 0;
+    for (uint16_t i = 0; i < periodic_read_width(p_read); i++)
+    {
+        uint64_t word = frame->data[(offset + i) * 2] << 8 | frame->data[(offset + i) * 2 + 1];
+        value |= word << periodic_read_word_shift(p_read, i);
+    }
+    return value;
+}
+
+// Numeric value of a periodic read, as declared by its type
+static double periodic_read_number(const struct bus_periodic_read *p_read, uint64_t data)
+{
+    switch (p_read->type & ~PERIODIC_READ_WORD_SWAP)
+    {
+    case PERIODIC_READ_TYPE_INT16:
+        return (int16_t)data;
+    case PERIODIC_READ_TYPE_UINT32:
+        return (uint32_t)data;
+    case PERIODIC_READ_TYPE_INT32:
+        return (int32_t)data;
+    case PERIODIC_READ_TYPE_FLOAT32:
+    {
+        uint32_t bits = data;
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    case PERIODIC_READ_TYPE_UINT64:
+        return data;
+    case PERIODIC_READ_TYPE_INT64:
+        return (int64_t)data;
+    case PERIODIC_READ_TYPE_FLOAT64:
+    {
+        double value;
+        memcpy(&value, &data, sizeof(value));
+        return value;
+    }
+    default:
+        return (uint16_t)data;
+    }
+}
+
+/**
+ * If a new value of a periodic read passes its filter, against the last value reported to the host.
+ */
+static bool periodic_read_filter(const struct bus_periodic_read *p_read, uint64_t data)
+{
+    if (data == p_read->reported)
+    {
+        return false;
+    }
+    switch (p_read->filter)
+    {
+    case PERIODIC_FILTER_MASK:
+        return ((data ^ p_read->reported) & p_read->filter_value) != 0;
+    case PERIODIC_FILTER_ABSOLUTE:
+    case PERIODIC_FILTER_PERCENT:
+    {
+        double value = periodic_read_number(p_read, data);
+        double reported = periodic_read_number(p_read, p_read->reported);
+        // Going to or from NaN has no distance, but it is a change
+        if (isnan(value) || isnan(reported))
+        {
+            return true;
+        }
+        double band;
+        if (p_read->filter == PERIODIC_FILTER_PERCENT)
+        {
+            band = fabs(reported) * p_read->filter_value / 10000.0;
+        }
+        else
+        {
+            uint8_t type = p_read->type & ~PERIODIC_READ_WORD_SWAP;
+            bool real = type == PERIODIC_READ_TYPE_FLOAT32 || type == PERIODIC_READ_TYPE_FLOAT64;
+            band = real ? p_read->filter_value / 100.0 : p_read->filter_value;
+        }
+        return fabs(value - reported) > band;
+    }
+    default:
+        return true;
+    }
+}
+
+/**
+ * Store a new value of a periodic read, sending it to the host if it changed past its filter.
+ * The first value read is always reported, even if it is 0, so the host gets it whatever the filter.
+ * @return true if the value was reported.
+ */
+static bool periodic_read_update(struct bus_context *bus_context, struct bus_periodic_read *p_read, uint64_t data)
+{
+    struct m_command reply = {0};
+    reply.device.bus = bus_context->bus;
+    reply.device.slave = p_read->slave;
+    reply.device.function = p_read->function;
+    reply.device.address = p_read->address;
+    // Single registers and coils keep the 16 bits message, wider values go whole in a single message
+    if (periodic_read_width(p_read) == 1)
+    {
+        reply.type = MESSAGE_PERIODIC_READ_REPLY;
+        reply.msg.periodic_change.data = data;
+        // Every bit of the first value is new to the host
+        reply.msg.periodic_change.data_mask = p_read->valid ? data ^ p_read->reported : 0xFFFF;
+    }
+    else
+    {
+        reply.type = MESSAGE_PERIODIC_VALUE_REPLY;
+        reply.msg.periodic_value.data = data;
+        reply.msg.periodic_value.type = p_read->type;
+    }
+    bool changed = !p_read->valid || periodic_read_filter(p_read, data);
+    // If there is any change, send it to the host
+    if (changed)
+    {
+        p_read->reported = data;
+#ifdef BUS_DEBUG_PERIODIC_READS
+        LOG_INFO(DEVF_FMT "Change detected %s",
+                 bus_context->bus, reply.device.slave, reply.device.address, reply.device.function,
+                 to_bin_hex_string((uint8_t *)&data, periodic_read_width(p_read) * 2));
+#endif
+        if (!xQueueSend(host_change_queue, &reply, FREERTOS_NO_WAIT))
+        {
+            LOG_ERROR("Bus %u could not send change to queue, queue full!", bus_context->bus);
+        }
+    }
+    // Copy new read values to the last_values array
+    taskENTER_CRITICAL();
+    p_read->last_data = data;
+    p_read->valid = true;
+    p_read->updated_at = xTaskGetTickCount();
+    taskEXIT_CRITICAL();
+
+    return changed;
+}
+
+//
+// Periodic groups scheduling
+// Binary min-heap of groups keyed on next_run, the root is the earliest deadline.
+//
+
+static void periodic_heap_swap(struct bus_context *bus_context, size_t a, size_t b)
+{
+    struct bus_periodic_group **heap = bus_context->periodic_heap;
+    struct bus_periodic_group *tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->heap_index = a;
+    heap[b]->heap_index = b;
+}
+
+static void periodic_heap_sift_up(struct bus_context *bus_context, size_t index)
+{
+    struct bus_periodic_group **heap = bus_context->periodic_heap;
+    while (index > 0)
+    {
+        size_t parent = (index - 1) / 2;
+        if (!TICK_BEFORE(heap[index]->next_run, heap[parent]->next_run))
+        {
+            break;
+        }
+        periodic_heap_swap(bus_context, index, parent);
+        index = parent;
+    }
+}
+
+static void periodic_heap_sift_down(struct bus_context *bus_context, size_t index)
+{
+    struct bus_periodic_group **heap = bus_context->periodic_heap;
+    size_t len = bus_context->periodic_groups_len;
+    while (true)
+    {
+        size_t smallest = index;
+        size_t left = index * 2 + 1;
+        size_t right = left + 1;
+        if (left < len && TICK_BEFORE(heap[left]->next_run, heap[smallest]->next_run))
+        {
+            smallest = left;
+        }
+        if (right < len && TICK_BEFORE(heap[right]->next_run, heap[smallest]->next_run))
+        {
+            smallest = right;
+        }
+        if (smallest == index)
+        {
+            break;
+        }
+        periodic_heap_swap(bus_context, index, smallest);
+        index = smallest;
+    }
+}
+
+/**
+ * Spread the first run of the groups over their interval, so they don't all fire in the same tick.
+ */
+static void periodic_schedule_init(struct bus_context *bus_context)
+{
+    size_t len = bus_context->periodic_groups_len;
+    TickType_t now = xTaskGetTickCount();
+
+    if (len == 0)
+    {
+        return;
+    }
+    bus_context->periodic_heap = pvPortCalloc(len, sizeof(struct bus_periodic_group *));
+    for (size_t i = 0; i < len; i++)
+    {
+        struct bus_periodic_group *group = &bus_context->periodic_groups[i];
+        group->next_run = now + (pdMS_TO_TICKS(group->interval) * i) / len;
+        group->heap_index = i;
+        bus_context->periodic_heap[i] = group;
+    }
+    for (size_t i = len / 2; i > 0; i--)
+    {
+        periodic_heap_sift_down(bus_context, i - 1);
+    }
+}
+
+/**
+ * Return the group with the earliest deadline, NULL if there is no periodic read.
+ */
+static inline struct bus_periodic_group *periodic_schedule_peek(struct bus_context *bus_context)
+{
+    return bus_context->periodic_groups_len ? bus_context->periodic_heap[0] : NULL;
+}
+
+/**
+ * Period of a group, the burst interval while its burst window is open.
+ */
+static TickType_t periodic_schedule_period(struct bus_context *bus_context, struct bus_periodic_group *group)
+{
+    uint16_t interval = group->interval;
+    if (group->burst)
+    {
+        if (TICK_BEFORE(xTaskGetTickCount(), group->burst_until))
+        {
+            interval = MIN(interval, bus_context->burst_interval);
+        }
+        else
+        {
+            group->burst = false;
+        }
+    }
+    return MAX(pdMS_TO_TICKS(interval), 1);
+}
+
+/**
+ * Schedule the next run of a group from its previous deadline, so its period doesn't drift.
+ */
+static void periodic_schedule_next(struct bus_context *bus_context, struct bus_periodic_group *group)
+{
+    TickType_t period = periodic_schedule_period(bus_context, group);
+    TickType_t now = xTaskGetTickCount();
+
+    group->next_run += period;
+    // If we are late more than a period, skip the missed runs, keeping the phase
+    if (TICK_BEFORE(group->next_run, now))
+    {
+        group->next_run += ((now - group->next_run) / period + 1) * period;
+    }
+    periodic_heap_sift_down(bus_context, group->heap_index);
+}
+
+/**
+ * Defer a group until a given tick, without running it.
+ */
+static void periodic_schedule_defer(struct bus_context *bus_context, struct bus_periodic_group *group, TickType_t next_run)
+{
+    group->next_run = next_run;
+    periodic_heap_sift_down(bus_context, group->heap_index);
+}
+
+/**
+ * Poll a group at the burst interval until the burst window ends, restarting the window if it is
+ * already open.
+ */
+static void periodic_schedule_burst(struct bus_context *bus_context, struct bus_periodic_group *group)
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t next_run = now + pdMS_TO_TICKS(bus_context->burst_interval);
+
+    group->burst = true;
+    group->burst_until = now + pdMS_TO_TICKS(bus_context->burst_window);
+    if (TICK_BEFORE(next_run, group->next_run))
+    {
+        group->next_run = next_run;
+        periodic_heap_sift_up(bus_context, group->heap_index);
+    }
+}
+
+/**
+ * Start burst polling after a change in a group, on the group or on all groups of its slave.
+ */
+static void periodic_schedule_change(struct bus_context *bus_context, struct bus_periodic_group *group)
+{
+    if (bus_context->burst_interval == 0)
+    {
+        return;
+    }
+    if (!bus_context->burst_slave)
+    {
+        periodic_schedule_burst(bus_context, group);
+        return;
+    }
+    for (size_t i = 0; i < bus_context->periodic_groups_len; i++)
+    {
+        struct bus_periodic_group *other = &bus_context->periodic_groups[i];
+        if (other->slave == group->slave)
+        {
+            periodic_schedule_burst(bus_context, other);
+        }
+    }
+}
+
+/**
+ * Bring forward a group, so it runs as soon as possible.
+ */
+static void periodic_schedule_now(struct bus_context *bus_context, struct bus_periodic_group *group)
+{
+    TickType_t now = xTaskGetTickCount();
+    if (TICK_BEFORE(now, group->next_run))
+    {
+        group->next_run = now;
+        periodic_heap_sift_up(bus_context, group->heap_index);
+    }
+}
+
+/**
+ * Bring forward all groups of a slave, so they run as soon as possible.
+ */
+static void periodic_schedule_slave_now(struct bus_context *bus_context, uint8_t slave)
+{
+    for (size_t i = 0; i < bus_context->periodic_groups_len; i++)
+    {
+        struct bus_periodic_group *group = &bus_context->periodic_groups[i];
+        if (group->slave == slave)
+        {
+            periodic_schedule_now(bus_context, group);
+        }
+    }
+}
+
+/**
+ * Bring forward the groups polling a holding register, so its new value is read as soon as possible.
+ */
+static void periodic_schedule_register_now(struct bus_context *bus_context, uint8_t slave, uint16_t address)
+{
+    for (size_t i = 0; i < bus_context->periodic_groups_len; i++)
+    {
+        struct bus_periodic_group *group = &bus_context->periodic_groups[i];
+        if (group->slave == slave && group->function == MODBUS_FUNCTION_READ_HOLDING_REGISTERS &&
+            group->address <= address && (uint32_t)group->address + group->quantity > address)
+        {
+            periodic_schedule_now(bus_context, group);
+        }
+    }
+}
+
+//
+// Response timeout
+// Each slave has a smoothed response latency and its variance, TCP RTO style.
+//
+
+/**
+ * Get the timing state of a slave, allocating a free entry if needed.
+ * @return NULL if there is no free entry.
+ */
+static struct bus_slave *bus_get_slave(struct bus_context *bus_context, uint8_t slave)
+{
+    struct bus_slave *free_slave = NULL;
+    for (size_t i = 0; i < BUS_MAX_SLAVES; i++)
+    {
+        struct bus_slave *bus_slave = &bus_context->slaves[i];
+        if (bus_slave->used && bus_slave->slave == slave)
+        {
+            return bus_slave;
+        }
+        if (!bus_slave->used && free_slave == NULL)
+        {
+            free_slave = bus_slave;
+        }
+    }
+    if (free_slave != NULL)
+    {
+        memset(free_slave, 0, sizeof(struct bus_slave));
+        free_slave->used = true;
+        free_slave->slave = slave;
+    }
+    return free_slave;
+}
+
+// Time to transfer a number of bytes in the bus, 8N1 = 10 bits per byte
+static inline uint32_t bus_transfer_time_us(struct bus_context *bus_context, size_t bytes)
+{
+    return (uint32_t)((bytes * 10 * 1000000ull) / bus_context->pio_uart->super.baudrate);
+}
+
+// Modbus RTU silence between frames, 3.5 characters of 11 bits, fixed at 1750us above 19200 baud
+static inline uint32_t bus_silence_time_us(struct bus_context *bus_context)
+{
+    uint32_t baudrate = bus_context->pio_uart->super.baudrate;
+    if (baudrate > 19200)
+    {
+        return 1750;
+    }
+    return (uint32_t)((35 * 11 * 1000000ull) / (10 * baudrate));
+}
+
+/**
+ * Wait until the bus has been silent for 3.5 characters since the last frame.
+ */
+static void bus_wait_silence(struct bus_context *bus_context)
+{
+    uint32_t silence_us = bus_silence_time_us(bus_context);
+    uint32_t elapsed_us = time_us_32() - bus_context->last_frame_us;
+    if (elapsed_us >= silence_us)
+    {
+        return;
+    }
+    uint32_t remaining_us = silence_us - elapsed_us;
+    // Block for the ticks, rounded up, so the other bus tasks of this core run meanwhile.
+    // A delay ends on a tick, only what is left below the tick resolution is busy waited.
+    uint32_t tick_us = 1000000 / configTICK_RATE_HZ;
+    if (remaining_us >= tick_us)
+    {
+        vTaskDelay((remaining_us + tick_us - 1) / tick_us);
+        elapsed_us = time_us_32() - bus_context->last_frame_us;
+        remaining_us = elapsed_us < silence_us ? silence_us - elapsed_us : 0;
+    }
+    if (remaining_us > 0)
+    {
+        busy_wait_us_32(remaining_us);
+    }
+}
+
+/**
+ * Response timeout, in us, after the request is sent: the response transfer time, plus the
+ * slave latency estimation. Limited by BUS_TIMEOUT_RESPONSE_MIN and BUS_TIMEOUT_RESPONSE.
+ */
+static uint32_t bus_response_timeout_us(struct bus_context *bus_context, struct bus_slave *bus_slave, size_t rx_size)
+{
+    // Without any sample or expected response size, use the max timeout
+    if (bus_slave == NULL || bus_slave->srtt_us == 0 || rx_size == 0)
+    {
+        return BUS_TIMEOUT_RESPONSE * 1000;
+    }
+    uint32_t timeout_us = bus_transfer_time_us(bus_context, rx_size) +
+                          bus_slave->srtt_us + 4 * bus_slave->rttvar_us;
+    return MIN(MAX(timeout_us, BUS_TIMEOUT_RESPONSE_MIN * 1000), BUS_TIMEOUT_RESPONSE * 1000);
+}
+
+// Update the slave latency estimation with a new sample
+static void bus_slave_rtt_sample(struct bus_slave *bus_slave, uint32_t latency_us)
+{
+    if (bus_slave == NULL)
+    {
+        return;
+    }
+    latency_us = MAX(latency_us, 1); // srtt_us == 0 means no sample
+    if (bus_slave->srtt_us == 0)
+    {
+        bus_slave->srtt_us = latency_us;
+        bus_slave->rttvar_us = latency_us / 2;
+    }
+    else
+    {
+        uint32_t delta = latency_us > bus_slave->srtt_us ? latency_us - bus_slave->srtt_us : bus_slave->srtt_us - latency_us;
+        bus_slave->rttvar_us = (3 * bus_slave->rttvar_us + delta) / 4;
+        bus_slave->srtt_us = (7 * bus_slave->srtt_us + latency_us) / 8;
+    }
+}
+
+// A timeout may be caused by a too tight estimation, back it off so the next try waits longer
+static void bus_slave_rtt_timeout(struct bus_slave *bus_slave)
+{
+    if (bus_slave == NULL || bus_slave->srtt_us == 0)
+    {
+        return;
+    }
+    bus_slave->rttvar_us = MIN(MAX(bus_slave->rttvar_us * 2, 1000), BUS_TIMEOUT_RESPONSE * 1000);
+}
+
+//
+// Slave health
+// After BUS_SLAVE_OFFLINE_TIMEOUTS consecutive timeouts a slave is offline, and its periodic
+// groups are only probed with an exponential backoff, so a dead slave doesn't hold the bus.
+//
+
+static void bus_slave_notify(struct bus_context *bus_context, struct bus_slave *bus_slave)
+{
+    struct m_command reply = {0};
+    reply.type = MESSAGE_SLAVE_STATUS;
+    reply.device.bus = bus_context->bus;
+    reply.device.slave = bus_slave->slave;
+    reply.msg.slave_status.online = !bus_slave->offline;
+    if (!xQueueSend(host_change_queue, &reply, FREERTOS_NO_WAIT))
+    {
+        LOG_ERROR("Bus %u could not send slave status to queue, queue full!", bus_context->bus);
+    }
+}
+
+static void bus_slave_health_update(struct bus_context *bus_context, struct bus_slave *bus_slave, enum modbus_result result)
+{
+    if (bus_slave == NULL)
+    {
+        return;
+    }
+    switch (result)
+    {
+    case MODBUS_COMPLETE:
+    case MODBUS_ERROR_EXCEPTION:
+        // The slave answered
+        bus_slave->timeouts = 0;
+        if (bus_slave->offline)
+        {
+            LOG_INFO("B:%u S:%u | Slave online", bus_context->bus, bus_slave->slave);
+            bus_slave->offline = false;
+            bus_slave_notify(bus_context, bus_slave);
+            periodic_schedule_slave_now(bus_context, bus_slave->slave);
+        }
+        break;
+    default:
+        // Only a reply with a valid CRC shows the slave is there, garbage is a glitch or an echo
+        if (bus_slave->offline)
+        {
+            // Failed probe, back off
+            bus_slave->backoff = MIN(bus_slave->backoff * 2, BUS_SLAVE_BACKOFF_MAX);
+            bus_slave->next_probe = NEXT_TIMEOUT(bus_slave->backoff);
+        }
+        else if (++bus_slave->timeouts >= BUS_SLAVE_OFFLINE_TIMEOUTS)
+        {
+            LOG_ERROR("B:%u S:%u | Slave offline", bus_context->bus, bus_slave->slave);
+            bus_slave->offline = true;
+            bus_slave->backoff = BUS_SLAVE_BACKOFF_MIN;
+            bus_slave->next_probe = NEXT_TIMEOUT(bus_slave->backoff);
+            bus_slave_notify(bus_context, bus_slave);
+        }
+        break;
+    }
+}
+
+/**
+ * Send a frame after the bus silence and wait until it is out of the UART.
+ */
+static void bus_transmit(struct bus_context *bus_context, uint8_t slave, uint16_t address, const uint8_t *tx_frame, size_t frame_size)
+{
+    struct pio_uart *uart = bus_context->pio_uart;
+
+#ifdef BUS_DEBUG_MODBUS_TX_FRAME
+    LOG_DEBUG(DEV_FMT "Modbus Tx Frame: %s",
+              bus_context->bus, slave, address, to_hex_string(tx_frame, frame_size));
+#endif
+
+    bus_wait_silence(bus_context);                             // Respect the silence after the last frame in the bus
+    pio_uart_rx_flush(uart);                                   // Flush any remaining byte in the UART RX buffer
+    pio_uart_write_bytes_blocking(uart, tx_frame, frame_size); // Write the frame to the UART
+
+    // Release the CPU until the frame is sent, the TX done ISR wakes us up
+    uint32_t tx_time_us = bus_transfer_time_us(bus_context, frame_size);
+    if (!pio_uart_wait_tx_done(uart, pdMS_TO_TICKS(tx_time_us / 1000 + BUS_TIMEOUT_TX_DONE)))
+    {
+        LOG_ERROR(DEV_FMT "Timeout sending Modbus Frame", bus_context->bus, slave, address);
+    }
+}
+
+/**
+ * Send a broadcast frame. No slave replies, so there is nothing to parse, only the turnaround
+ * delay for the slaves to process it before the bus is used again.
+ */
+static void send_modbus_broadcast(struct bus_context *bus_context, uint16_t address, const uint8_t *tx_frame, size_t frame_size)
+{
+    bus_transmit(bus_context, MODBUS_BROADCAST_ADDRESS, address, tx_frame, frame_size);
+    vTaskDelay(pdMS_TO_TICKS(BUS_DELAY_BROADCAST_TURNAROUND));
+    bus_context->last_frame_us = time_us_32();
+}
+
+static enum modbus_result send_modbus_frame(struct bus_context *bus_context, uint8_t slave, uint16_t address, const uint8_t *tx_frame, size_t frame_size, struct modbus_frame *rx_frame)
+{
+    struct modbus_parser parser;
+    TickType_t last_timeout = 0;
+    uint8_t bus = bus_context->bus;
+    struct pio_uart *uart = bus_context->pio_uart;
+    struct bus_slave *bus_slave = bus_get_slave(bus_context, slave);
+    size_t response_size = modbus_expected_response_size(tx_frame, frame_size);
+
+    bus_transmit(bus_context, slave, address, tx_frame, frame_size);
+
+    uint32_t timeout_us = bus_response_timeout_us(bus_context, bus_slave, response_size);
+    // Tick granularity, round up and add one tick, as the current tick is already running
+    TickType_t timeout_max_tick = xTaskGetTickCount() + pdMS_TO_TICKS((timeout_us + 999) / 1000) + 1; // Start timeout counter
+    uint32_t start_us = time_us_32();
+
+    // Hunt for the reply of this request, received straight in the bus buffer
+    modbus_parser_expect(&parser,
+                         bus_context->rx_buffer,
+                         sizeof(bus_context->rx_buffer),
+                         slave,
+                         tx_frame[1],
+                         response_size);
+
+    while (true)
+    {
+        TickType_t now = xTaskGetTickCount();
+        if (!TICK_BEFORE(now, timeout_max_tick)) // Check if the timeout has expired
+        {
+            bus_context->last_frame_us = time_us_32();
+            // No valid reply, whatever was received, the slave didn't answer
+            bus_slave_rtt_timeout(bus_slave);
+            bus_slave_health_update(bus_context, bus_slave, MODBUS_ERROR_TIMEOUT);
+            if (parser.last_error != MODBUS_INCOMPLETE)
+            {
+                // Something was received, but no valid reply was found in it
+                LOG_ERROR(DEV_FMT "Error %u parsing Modbus Frame", bus, slave, address, parser.last_error);
+                return parser.last_error;
+            }
+            // FIXME: This contention to print timeout is not doing anything useful.
+            // This function will print several timeouts for each time it is called
+            if (IS_EXPIRED(last_timeout)) // Check if we need to print a timeout message
+            {
+                LOG_ERROR(DEV_FMT "Timeout", bus, slave, address);
+                last_timeout = NEXT_TIMEOUT(BUS_DELAY_TIMEOUT_MSG);
+            }
+            // Go to next module if timeout
+            break; // while, process next module
+        }
+
+        // Release CPU until some byte arrive in the UART, the RX ISR wakes us up, then drain all bytes available
+        size_t room;
+        uint8_t *read_buffer = modbus_parser_reserve(&parser, &room);
+        size_t read_len = pio_uart_read_bytes_timeout(uart, read_buffer, room, timeout_max_tick - now);
+
+        // Process parser result, errors are skipped while hunting for the reply
+        enum modbus_result parser_status = modbus_parser_commit(&parser, rx_frame, read_len);
+        if (parser_status != MODBUS_INCOMPLETE)
+        {
+            bus_context->last_frame_us = time_us_32();
+        }
+        if (parser_status == MODBUS_ERROR_EXCEPTION)
+        {
+            LOG_ERROR(DEV_FMT "Modbus exception %02X", bus, slave, address, rx_frame->data[0]);
+            bus_slave_health_update(bus_context, bus_slave, parser_status);
+            return parser_status;
+        }
+        else if (parser_status == MODBUS_COMPLETE)
+        {
+            // The slave latency is what is left after the response transfer time
+            uint32_t elapsed_us = bus_context->last_frame_us - start_us;
+            uint32_t transfer_us = bus_transfer_time_us(bus_context, response_size);
+            bus_slave_rtt_sample(bus_slave, elapsed_us > transfer_us ? elapsed_us - transfer_us : 0);
+            bus_slave_health_update(bus_context, bus_slave, MODBUS_COMPLETE);
+#ifdef BUS_DEBUG_MODBUS_RX_FRAME
+            LOG_DEBUG(DEV_FMT "Modbus Rx Frame: %s",
+                      bus, slave, address, to_hex_string(rx_frame->data, rx_frame->data_size));
+#endif
+            return MODBUS_COMPLETE;
+        }
+    }
+    return MODBUS_ERROR_TIMEOUT;
+}
+
+//
+// Retries
+// Command transactions are retried in the gateway, a few ms instead of a full host round trip.
+// Only errors a new attempt can fix are retried: no answer or a corrupted one. An exception is the
+// slave answer, and an offline slave is not worth holding the bus for.
+//
+
+static bool bus_result_retryable(enum modbus_result result)
+{
+    return result == MODBUS_ERROR_TIMEOUT ||
+           result == MODBUS_ERROR_CRC ||
+           result == MODBUS_ERROR_SLAVE ||
+           result == MODBUS_ERROR_FUNCTION ||
+           result == MODBUS_ERROR_LENGTH;
+}
+
+/**
+ * Send a frame as send_modbus_frame, retrying it with the bus retry policy.
+ * @param retries Set to the attempts made after the first one.
+ */
+static enum modbus_result send_modbus_frame_retry(struct bus_context *bus_context,
+                                                  uint8_t slave,
+                                                  uint16_t address,
+                                                  const uint8_t *tx_frame,
+                                                  size_t frame_size,
+                                                  struct modbus_frame *rx_frame,
+                                                  uint8_t *retries)
+{
+    struct bus_slave *bus_slave = bus_get_slave(bus_context, slave);
+    enum modbus_result result = send_modbus_frame(bus_context, slave, address, tx_frame, frame_size, rx_frame);
+
+    *retries = 0;
+    while (bus_result_retryable(result) &&
+           *retries < bus_context->retry_max &&
+           (bus_slave == NULL || !bus_slave->offline))
+    {
+        // The shift is bounded, so the doubled backoff can't overflow before the cap
+        uint32_t backoff = (uint32_t)bus_context->retry_backoff << MIN(*retries, 7);
+        vTaskDelay(pdMS_TO_TICKS(MIN(backoff, BUS_RETRY_BACKOFF_MAX)));
+        (*retries)++;
+        LOG_DEBUG(DEV_FMT "Retry %u after error %u", bus_context->bus, slave, address, *retries, result);
+        result = send_modbus_frame(bus_context, slave, address, tx_frame, frame_size, rx_frame);
+    }
+    return result;
+}
+
+static void process_periodic_group(struct bus_context *bus_context, struct bus_periodic_group *group)
+{
+    struct modbus_frame rx_frame;
+
+#ifdef BUS_DEBUG_PERIODIC_READS
+    LOG_DEBUG(DEVF_FMT "Periodic Read, Quantity: %u",
+              bus_context->bus, group->slave, group->address, group->function, group->quantity);
+#endif
+
+    if (group->frame_size == 0)
+    {
+        return;
+    }
+
+    if (send_modbus_frame(
+            bus_context,
+            group->slave,
+            group->address,
+            group->frame,
+            group->frame_size,
+            &rx_frame) == MODBUS_COMPLETE)
+    {
+        if (rx_frame.function_code != group->function)
+        {
+            LOG_ERROR(DEVF_FMT "Modbus Frame wrong function code %02X",
+                      bus_context->bus, group->slave, group->address, group->function,
+                      rx_frame.function_code);
+        }
+        else
+        {
+            process_periodic_reply(bus_context, group, &rx_frame);
+        }
+    }
+}
+
+//
+// Pending commands
+// Commands are moved from the command queue to the pending array, so we can look ahead of
+// the command being processed. The host task looks at them too, see bus_cache_read, so they
+// only change in a critical section.
+//
+
+/**
+ * Reply to a block read, with data_size bytes of data if it was done.
+ */
+static void bus_block_read_reply(struct bus_context *bus_context,
+                                 const struct m_block_read *block,
+                                 uint8_t status,
+                                 uint8_t retries,
+                                 const uint8_t *data,
+                                 size_t data_size)
+{
+    struct host_message *message = host_message_new(MESSAGE_BLOCK_READ_REPLY, sizeof(struct m_block_read_reply) + data_size);
+    if (message == NULL)
+    {
+        LOG_ERROR("Bus %u could not allocate block read reply!", bus_context->bus);
+        return;
+    }
+    struct m_block_read_reply *reply = (struct m_block_read_reply *)message->payload;
+    reply->seq = block->seq;
+    reply->device = block->device;
+    reply->status = status;
+    reply->retries = retries;
+    reply->quantity = block->quantity;
+    reply->data_size = data_size;
+    memcpy(reply->data, data, data_size);
+    if (!host_message_send(message))
+    {
+        LOG_ERROR("Bus %u could not send block read reply to queue, queue full!", bus_context->bus);
+    }
+}
+
+static void bus_block_write_reply(struct bus_context *bus_context,
+                                  const struct m_block_write *block,
+                                  uint8_t status,
+                                  uint8_t retries)
+{
+    struct host_message *message = host_message_new(MESSAGE_BLOCK_WRITE_REPLY, sizeof(struct m_block_write_reply));
+    if (message == NULL)
+    {
+        LOG_ERROR("Bus %u could not allocate block write reply!", bus_context->bus);
+        return;
+    }
+    struct m_block_write_reply *reply = (struct m_block_write_reply *)message->payload;
+    reply->seq = block->seq;
+    reply->device = block->device;
+    reply->status = status;
+    reply->retries = retries;
+    reply->quantity = block->quantity;
+    if (!host_message_send(message))
+    {
+        LOG_ERROR("Bus %u could not send block write reply to queue, queue full!", bus_context->bus);
+    }
+}
+
+/**
+ * Reply to a raw command, with the response PDU if it was done.
+ */
+static void bus_raw_reply(struct bus_context *bus_context,
+                          const struct m_raw *raw,
+                          uint8_t status,
+                          uint8_t result,
+                          const uint8_t *pdu,
+                          size_t pdu_size)
+{
+    struct host_message *message = host_message_new(MESSAGE_RAW_REPLY, sizeof(struct m_raw_reply) + pdu_size);
+    if (message == NULL)
+    {
+        LOG_ERROR("Bus %u could not allocate raw reply!", bus_context->bus);
+        return;
+    }
+    struct m_raw_reply *reply = (struct m_raw_reply *)message->payload;
+    reply->seq = raw->seq;
+    reply->bus = raw->bus;
+    reply->slave = raw->slave;
+    reply->status = status;
+    reply->result = result;
+    reply->pdu_size = pdu_size;
+    memcpy(reply->pdu, pdu, pdu_size);
+    if (!host_message_send(message))
+    {
+        LOG_ERROR("Bus %u could not send raw reply to queue, queue full!", bus_context->bus);
+    }
+}
+
+/**
+ * Reply to a command that was not run, with the reason.
+ */
+static void bus_command_reply_status(struct bus_context *bus_context, const struct bus_command *bus_command, uint8_t status)
+{
+    const struct m_command *command = &bus_command->command;
+    struct m_command reply = {
+        .seq = command->seq,
+        .device = command->device,
+    };
+    switch (command->type)
+    {
+    case MESSAGE_COMMAND_READ:
+        reply.type = MESSAGE_COMMAND_READ_REPLY;
+        reply.msg.read_reply.done = false;
+        reply.msg.read_reply.status = status;
+        break;
+    case MESSAGE_COMMAND_WRITE:
+        reply.type = MESSAGE_COMMAND_WRITE_REPLY;
+        reply.msg.write_reply.done = false;
+        reply.msg.write_reply.status = status;
+        break;
+    case MESSAGE_COMMAND_BROADCAST:
+        reply.type = MESSAGE_COMMAND_BROADCAST_REPLY;
+        reply.msg.write_reply.done = false;
+        reply.msg.write_reply.status = status;
+        break;
+    case MESSAGE_COMMAND_MASK_WRITE:
+        reply.type = MESSAGE_COMMAND_MASK_WRITE_REPLY;
+        reply.msg.write_reply.done = false;
+        reply.msg.write_reply.status = status;
+        break;
+    case MESSAGE_COMMAND_READ_WRITE:
+        reply.type = MESSAGE_COMMAND_READ_WRITE_REPLY;
+        reply.msg.read_reply.done = false;
+        reply.msg.read_reply.status = status;
+        break;
+    case MESSAGE_BLOCK_READ:
+        bus_block_read_reply(bus_context, bus_command->block, status, 0, NULL, 0);
+        return;
+    case MESSAGE_BLOCK_WRITE:
+        bus_block_write_reply(bus_context, bus_command->block, status, 0);
+        return;
+    case MESSAGE_RAW:
+        bus_raw_reply(bus_context, bus_command->block, status, MODBUS_INCOMPLETE, NULL, 0);
+        return;
+    default:
+        return;
+    }
+    if (!xQueueSend(host_command_queue, &reply, FREERTOS_NO_WAIT))
+    {
+        LOG_ERROR("Bus %u could not send reply to queue, queue full!", bus_context->bus);
+    }
+}
+
+static void bus_pending_remove(struct bus_context *bus_context, size_t index)
+{
+    taskENTER_CRITICAL();
+    bus_context->pending_len--;
+    memmove(&bus_context->pending[index],
+            &bus_context->pending[index + 1],
+            (bus_context->pending_len - index) * sizeof(struct bus_command));
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * If a command may change the coils/registers of its slave, anything but a read is taken as a write.
+ */
+static bool bus_command_is_write(const struct m_command *command)
+{
+    return command->type != MESSAGE_COMMAND_READ && command->type != MESSAGE_BLOCK_READ;
+}
+
+/**
+ * If a write to a slave is running or pending, so its cached values may be about to change.
+ * Must be called in a critical section.
+ */
+static bool bus_pending_write(struct bus_context *bus_context, uint8_t slave)
+{
+    if (bus_context->running_write &&
+        (bus_context->running_slave == slave || bus_context->running_slave == MODBUS_BROADCAST_ADDRESS))
+    {
+        return true;
+    }
+    for (size_t i = 0; i < bus_context->pending_len; i++)
+    {
+        const struct m_command *other = &bus_context->pending[i].command;
+        if ((other->device.slave == slave || other->device.slave == MODBUS_BROADCAST_ADDRESS) &&
+            bus_command_is_write(other))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reply to a pending command that will not run and drop it.
+ */
+static void bus_pending_drop(struct bus_context *bus_context, size_t index, uint8_t status)
+{
+    bus_command_reply_status(bus_context, &bus_context->pending[index], status);
+    vPortFree(bus_context->pending[index].block);
+    bus_pending_remove(bus_context, index);
+}
+
+/**
+ * Drop a pending command by seq. Cancels are queued as any other command, so the command to
+ * cancel is already pending or was already run.
+ */
+static void bus_pending_cancel(struct bus_context *bus_context, uint8_t seq)
+{
+    for (size_t i = 0; i < bus_context->pending_len; i++)
+    {
+        const struct m_command *command = &bus_context->pending[i].command;
+        if (command->seq == seq)
+        {
+            LOG_DEBUG(DEVF_FMT "Command Cancelled - Seq: %u",
+                      bus_context->bus, command->device.slave, command->device.address, command->device.function,
+                      command->seq);
+            bus_pending_drop(bus_context, i, COMMAND_STATUS_CANCELLED);
+            return;
+        }
+    }
+    LOG_DEBUG("Bus %u nothing to cancel with Seq: %u", bus_context->bus, seq);
+}
+
+/**
+ * Drop the pending commands whose deadline has passed, so no bus time is spent on them.
+ */
+static void bus_pending_expire(struct bus_context *bus_context)
+{
+    TickType_t now = xTaskGetTickCount();
+    size_t i = 0;
+    while (i < bus_context->pending_len)
+    {
+        const struct bus_command *pending = &bus_context->pending[i];
+        if (pending->expires && !TICK_BEFORE(now, pending->deadline))
+        {
+            LOG_DEBUG(DEVF_FMT "Command Expired - Seq: %u",
+                      bus_context->bus, pending->command.device.slave, pending->command.device.address,
+                      pending->command.device.function, pending->command.seq);
+            bus_pending_drop(bus_context, i, COMMAND_STATUS_EXPIRED);
+            continue;
+        }
+        i++;
+    }
+}
+
+/**
+ * Move queued commands to the pending array, waiting up to wait ticks if there is none pending.
+ * Cancels are applied as they are received and expired commands are dropped.
+ * @return false if there is no command pending.
+ */
+static bool bus_pending_fill(struct bus_context *bus_context, TickType_t wait)
+{
+    struct bus_command command;
+    TickType_t timeout = bus_context->pending_len ? FREERTOS_NO_WAIT : wait;
+    while (bus_context->pending_len < BUS_PENDING_COMMANDS &&
+           xQueueReceive(bus_context->command_queue, &command, timeout))
+    {
+        timeout = FREERTOS_NO_WAIT;
+        if (command.command.type == MESSAGE_COMMAND_CANCEL)
+        {
+            bus_pending_cancel(bus_context, command.command.msg.cancel.seq);
+            continue;
+        }
+        taskENTER_CRITICAL();
+        bus_context->pending[bus_context->pending_len++] = command;
+        taskEXIT_CRITICAL();
+    }
+    bus_pending_expire(bus_context);
+    return bus_context->pending_len > 0;
+}
+
+static void bus_pending_pop(struct bus_context *bus_context, struct bus_command *command)
+{
+    *command = bus_context->pending[0];
+    bus_pending_remove(bus_context, 0);
+}
+
+/**
+ * Reply to pending reads of the same device with the reply of a read just done.
+ * Only this task drives the bus, so the value is still current for reads that arrived while the
+ * transaction was in flight. Any other command to the same slave, or a broadcast, stops the search,
+ * as later reads must see its effect.
+ */
+static void bus_pending_fanout(struct bus_context *bus_context, const struct m_command *command, struct m_command *reply)
+{
+    bus_pending_fill(bus_context, FREERTOS_NO_WAIT);
+
+    size_t i = 0;
+    while (i < bus_context->pending_len)
+    {
+        struct m_command *other = &bus_context->pending[i].command;
+        if (other->device.slave != command->device.slave && other->device.slave != MODBUS_BROADCAST_ADDRESS)
+        {
+            i++;
+            continue;
+        }
+        if (other->type != MESSAGE_COMMAND_READ)
+        {
+            break;
+        }
+        if (other->device.function == command->device.function &&
+            other->device.address == command->device.address)
+        {
+            reply->seq = other->seq;
+            LOG_DEBUG(DEVF_FMT "Duplicate Read - Seq: %u",
+                      bus_context->bus, other->device.slave, other->device.address, other->device.function,
+                      other->seq);
+            if (!xQueueSend(host_command_queue, reply, FREERTOS_NO_WAIT))
+            {
+                LOG_ERROR("Bus %u could not send read reply to queue, queue full!", bus_context->bus);
+            }
+            bus_pending_remove(bus_context, i);
+            continue;
+        }
+        i++;
+    }
+}
+
+//
+// Write batching
+// Queued writes to the same slave and function are merged in a single transaction. Writes to the
+// same coil/register collapse to the latest value and contiguous ones become a single Write Multiple
+// Coils/Registers frame.
+//
+
+// Each write takes an address, so a batch spans at most the command being processed plus the pending ones
+#define BUS_WRITE_BATCH_SIZE (BUS_PENDING_COMMANDS + 1)
+
+struct bus_write_batch
+{
+    uint16_t address;  // First coil/register
+    uint16_t quantity; // Contiguous coils/registers from address
+    uint16_t values[BUS_WRITE_BATCH_SIZE];
+    size_t commands_len; // Commands replied by the transaction, in arrival order
+    struct m_command commands[BUS_WRITE_BATCH_SIZE];
+};
+
+/**
+ * Max coils/registers a batch can write, limited by the transmit buffer.
+ */
+static uint16_t bus_write_batch_max_quantity(uint8_t function)
+{
+    // Fixed bytes of a multiple write request: slave, function, start (2), quantity (2), byteCount, CRC (2)
+    const size_t room = BUS_MODBUS_FRAME_BUFFER_SIZE - 9;
+    size_t max = function == MODBUS_FUNCTION_WRITE_SINGLE_COIL ? room * 8 : room / 2;
+    return max < BUS_WRITE_BATCH_SIZE ? max : BUS_WRITE_BATCH_SIZE;
+}
+
+static bool bus_write_batch_has_address(struct bus_context *bus_context,
+                                        const size_t *candidates,
+                                        size_t candidates_len,
+                                        uint16_t address)
+{
+    for (size_t i = 0; i < candidates_len; i++)
+    {
+        if (bus_context->pending[candidates[i]].command.device.address == address)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Build a batch around a write command, moving the pending writes it covers out of the pending array.
+ * Only writes before any other command to the same slave, or a broadcast, are considered, so that
+ * command still sees the writes queued before it and none queued after it.
+ */
+static void bus_write_batch_collect(struct bus_context *bus_context,
+                                    const struct m_command *command,
+                                    struct bus_write_batch *batch)
+{
+    size_t candidates[BUS_PENDING_COMMANDS];
+    size_t candidates_len = 0;
+
+    bus_pending_fill(bus_context, FREERTOS_NO_WAIT);
+    for (size_t i = 0; i < bus_context->pending_len; i++)
+    {
+        const struct m_command *other = &bus_context->pending[i].command;
+        if (other->device.slave != command->device.slave && other->device.slave != MODBUS_BROADCAST_ADDRESS)
+        {
+            continue;
+        }
+        if (other->type != MESSAGE_COMMAND_WRITE || other->device.function != command->device.function)
+        {
+            break;
+        }
+        candidates[candidates_len++] = i;
+    }
+
+    // Grow the range around the command address while there are writes to the adjacent addresses
+    const uint16_t max_quantity = bus_write_batch_max_quantity(command->device.function);
+    uint16_t first = command->device.address;
+    uint16_t last = first;
+    bool grown = true;
+    while (grown)
+    {
+        grown = false;
+        if (last - first + 1 < max_quantity && first > 0 &&
+            bus_write_batch_has_address(bus_context, candidates, candidates_len, first - 1))
+        {
+            first--;
+            grown = true;
+        }
+        if (last - first + 1 < max_quantity && last < UINT16_MAX &&
+            bus_write_batch_has_address(bus_context, candidates, candidates_len, last + 1))
+        {
+            last++;
+            grown = true;
+        }
+    }
+
+    batch->address = first;
+    batch->quantity = last - first + 1;
+    batch->values[command->device.address - first] = command->msg.write.data;
+    batch->commands[0] = *command;
+    batch->commands_len = 1;
+    // Candidates are in arrival order, so the latest write to an address wins
+    for (size_t i = 0; i < candidates_len; i++)
+    {
+        const struct m_command *other = &bus_context->pending[candidates[i]].command;
+        if (other->device.address >= first && other->device.address <= last)
+        {
+            batch->values[other->device.address - first] = other->msg.write.data;
+            batch->commands[batch->commands_len++] = *other;
+        }
+    }
+    for (size_t i = candidates_len; i-- > 0;)
+    {
+        uint16_t address = bus_context->pending[candidates[i]].command.device.address;
+        if (address >= first && address <= last)
+        {
+            bus_pending_remove(bus_context, candidates[i]);
+        }
+    }
+}
+
+/**
+ * Batch values as in a Write Multiple Coils/Registers request: registers big endian, coils packed LSB first.
+ */
+static void bus_write_batch_data(const struct bus_write_batch *batch, uint8_t function, uint8_t *data)
+{
+    for (size_t i = 0; i < batch->quantity; i++)
+    {
+        if (function == MODBUS_FUNCTION_WRITE_SINGLE_COIL)
+        {
+            if (i % 8 == 0)
+            {
+                data[i / 8] = 0;
+            }
+            if (batch->values[i])
+            {
+                data[i / 8] |= 1 << (i % 8);
+            }
+        }
+        else
+        {
+            data[i * 2] = batch->values[i] >> 8;
+            data[i * 2 + 1] = batch->values[i] & 0xFF;
+        }
+    }
+}
+
+static size_t bus_write_batch_frame(const struct bus_write_batch *batch,
+                                    const struct m_device *device,
+                                    uint8_t *frame,
+                                    size_t frame_size)
+{
+    if (batch->quantity == 1)
+    {
+        return modbus_create_write_frame(device->function, device->slave, batch->address, batch->values[0], frame, frame_size);
+    }
+    if (device->function == MODBUS_FUNCTION_WRITE_SINGLE_COIL)
+    {
+        uint8_t coils[(BUS_WRITE_BATCH_SIZE + 7) / 8];
+        bus_write_batch_data(batch, device->function, coils);
+        return modbus_create_write_multiple_coils_frame(device->slave, batch->address, coils, batch->quantity, frame, frame_size);
+    }
+    if (device->function == MODBUS_FUNCTION_WRITE_HOLDING_REGISTERS)
+    {
+        return modbus_create_write_multiple_registers_frame(device->slave, batch->address, batch->values, batch->quantity, frame, frame_size);
+    }
+    LOG_ERROR("Invalid Modbus function %u", device->function);
+    return 0;
+}
+
+//
+// Write-through
+// A successful write updates the periodic reads covering it with the acknowledged value and brings
+// their groups forward, so the host gets the feedback without waiting for the next poll.
+//
+
+/**
+ * Read function that polls what a write function writes, 0 if none.
+ */
+static uint8_t bus_write_read_function(uint8_t function)
+{
+    switch (function)
+    {
+    case MODBUS_FUNCTION_WRITE_SINGLE_COIL:
+    case MODBUS_FUNCTION_WRITE_COILS:
+        return MODBUS_FUNCTION_READ_COILS;
+    case 0x06: // Write Single Register
+    case MODBUS_FUNCTION_WRITE_HOLDING_REGISTERS:
+        return MODBUS_FUNCTION_READ_HOLDING_REGISTERS;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Update the periodic reads covering a write, data as in a Write Multiple Coils/Registers request.
+ * A broadcast write covers the periodic reads of every slave.
+ */
+static void periodic_write_through(struct bus_context *bus_context,
+                                   uint8_t slave,
+                                   uint8_t function,
+                                   uint16_t address,
+                                   uint16_t quantity,
+                                   const uint8_t *data)
+{
+    uint8_t read_function = bus_write_read_function(function);
+    uint32_t end = (uint32_t)address + quantity;
+
+    for (size_t g = 0; g < bus_context->periodic_groups_len; g++)
+    {
+        struct bus_periodic_group *group = &bus_context->periodic_groups[g];
+        if ((slave != MODBUS_BROADCAST_ADDRESS && group->slave != slave) || group->function != read_function ||
+            group->address >= end || (uint32_t)group->address + group->quantity <= address)
+        {
+            continue;
+        }
+
+        bool covered = false;
+        for (size_t r = 0; r < group->reads_len; r++)
+        {
+            struct bus_periodic_read *p_read = &bus_context->periodic_reads[group->reads_index + r];
+            uint16_t first = periodic_read_address(p_read);
+            uint16_t count = periodic_read_quantity(p_read);
+            if (first >= end || (uint32_t)first + count <= address)
+            {
+                continue;
+            }
+            covered = true;
+            // Coils not written would be unknown, the group read will bring them
+            if (!p_read->valid)
+            {
+                continue;
+            }
+
+            uint64_t value = p_read->last_data;
+            for (uint16_t i = 0; i < count; i++)
+            {
+                uint32_t target = (uint32_t)first + i;
+                if (target < address || target >= end)
+                {
+                    continue;
+                }
+                uint32_t offset = target - address;
+                if (read_function == MODBUS_FUNCTION_READ_COILS)
+                {
+                    // Same layout as periodic_read_extract, first byte on the high byte
+                    uint16_t bit = i < 8 ? 8 + i : i - 8;
+                    bool on = data[offset / 8] & (1 << (offset % 8));
+                    value = on ? value | (1 << bit) : value & ~(1 << bit);
+                }
+                else
+                {
+                    // Only the written registers of a wider value change
+                    uint64_t word = data[offset * 2] << 8 | data[offset * 2 + 1];
+                    uint8_t shift = periodic_read_word_shift(p_read, i);
+                    value = (value & ~((uint64_t)0xFFFF << shift)) | word << shift;
+                }
+            }
+            periodic_read_update(bus_context, p_read, value);
+        }
+        // Read back what the slave actually applied on the next slot
+        if (covered)
+        {
+            periodic_schedule_now(bus_context, group);
+        }
+    }
+}
+
+//
+// Block commands
+// Consecutive coils/registers in a single transaction, data as in the Modbus PDU.
+//
+
+/**
+ * Max coils/registers of a block command, limited by the Modbus spec, the MIN frame and our frame buffers.
+ */
+static uint16_t bus_block_max_quantity(uint8_t function)
+{
+    // Fixed bytes of a read reply: slave, function, byteCount, CRC (2)
+    const size_t rx_room = MIN(M_BLOCK_DATA_SIZE, BUS_MODBUS_FRAME_BUFFER_SIZE - 5);
+    // Fixed bytes of a multiple write request: slave, function, start (2), quantity (2), byteCount, CRC (2)
+    const size_t tx_room = MIN(M_BLOCK_DATA_SIZE, BUS_MODBUS_FRAME_BUFFER_SIZE - 9);
+    switch (function)
+    {
+    case MODBUS_FUNCTION_READ_COILS:
+    case MODBUS_FUNCTION_READ_DISCRETE_INPUTS:
+        return MIN(MODBUS_MAX_READ_COILS, rx_room * 8);
+    case MODBUS_FUNCTION_READ_HOLDING_REGISTERS:
+    case MODBUS_FUNCTION_READ_INPUT_REGISTERS:
+        return MIN(MODBUS_MAX_READ_REGISTERS, rx_room / 2);
+    case MODBUS_FUNCTION_WRITE_COILS:
+        return MIN(MODBUS_MAX_WRITE_COILS, tx_room * 8);
+    case MODBUS_FUNCTION_WRITE_HOLDING_REGISTERS:
+        return MIN(MODBUS_MAX_WRITE_REGISTERS, tx_room / 2);
+    default:
+        return 0;
+    }
+}
+
+static void process_block_read(struct bus_context *bus_context, const struct m_block_read *block)
+{
+    uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
+    struct modbus_frame rx_frame;
+    uint8_t retries = 0;
+    size_t tx_frame_size = 0;
+
+    struct m_device device = block->device;
+    if (block->quantity > 0 &&
+        block->quantity <= bus_block_max_quantity(device.function))
+    {
+        tx_frame_size = modbus_create_read_range_frame(
+            device.function,
+            device.slave,
+            device.address,
+            block->quantity,
+            tx_frame,
+            sizeof(tx_frame));
+    }
+    if (tx_frame_size == 0)
+    {
+        LOG_ERROR(DEVF_FMT "Block Read invalid, Quantity: %u",
+                  bus_context->bus, device.slave, device.address, device.function, block->quantity);
+        bus_block_read_reply(bus_context, block, COMMAND_STATUS_FAILED, retries, NULL, 0);
+        return;
+    }
+
+    uint16_t data_size = modbus_function_return_size(device.function, block->quantity);
+    if (send_modbus_frame_retry(
+            bus_context,
+            device.slave,
+            device.address,
+            tx_frame,
+            tx_frame_size,
+            &rx_frame,
+            &retries) == MODBUS_COMPLETE)
+    {
+        if (rx_frame.function_code != device.function || rx_frame.data_size != data_size)
+        {
+            LOG_ERROR(DEVF_FMT "Modbus Frame wrong function code %02X or data size %u",
+                      bus_context->bus, device.slave, device.address, device.function,
+                      rx_frame.function_code, rx_frame.data_size);
+        }
+        else
+        {
+            bus_block_read_reply(bus_context, block, COMMAND_STATUS_OK, retries, rx_frame.data, data_size);
+            return;
+        }
+    }
+    else
+    {
+        LOG_ERROR(DEVF_FMT "Modbus Frame send failed",
+                  bus_context->bus, device.slave, device.address, device.function);
+    }
+    bus_block_read_reply(bus_context, block, COMMAND_STATUS_FAILED, retries, NULL, 0);
+}
+
+static void process_block_write(struct bus_context *bus_context, const struct m_block_write *block)
+{
+    uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
+    struct modbus_frame rx_frame;
+    uint8_t retries = 0;
+    size_t tx_frame_size = 0;
+
+    struct m_device device = block->device;
+    if (block->quantity > 0 &&
+        block->quantity <= bus_block_max_quantity(device.function) &&
+        block->data_size == modbus_function_return_size(device.function, block->quantity))
+    {
+        if (device.function == MODBUS_FUNCTION_WRITE_COILS)
+        {
+            tx_frame_size = modbus_create_write_multiple_coils_frame(
+                device.slave,
+                device.address,
+                block->data,
+                block->quantity,
+                tx_frame,
+                sizeof(tx_frame));
+        }
+        else
+        {
+            uint16_t registers[M_BLOCK_DATA_SIZE / 2];
+            for (size_t i = 0; i < block->quantity; i++)
+            {
+                registers[i] = block->data[i * 2] << 8 | block->data[i * 2 + 1];
+            }
+            tx_frame_size = modbus_create_write_multiple_registers_frame(
+                device.slave,
+                device.address,
+                registers,
+                block->quantity,
+                tx_frame,
+                sizeof(tx_frame));
+        }
+    }
+    if (tx_frame_size == 0)
+    {
+        LOG_ERROR(DEVF_FMT "Block Write invalid, Quantity: %u, Data size: %u",
+                  bus_context->bus, device.slave, device.address, device.function,
+                  block->quantity, block->data_size);
+        bus_block_write_reply(bus_context, block, COMMAND_STATUS_FAILED, retries);
+        return;
+    }
+
+    uint8_t status = COMMAND_STATUS_FAILED;
+    if (send_modbus_frame_retry(
+            bus_context,
+            device.slave,
+            device.address,
+            tx_frame,
+            tx_frame_size,
+            &rx_frame,
+            &retries) == MODBUS_COMPLETE)
+    {
+        if (rx_frame.function_code != device.function)
+        {
+            LOG_ERROR(DEVF_FMT "Modbus Frame wrong function code %02X",
+                      bus_context->bus, device.slave, device.address, device.function,
+                      rx_frame.function_code);
+        }
+        else
+        {
+            status = COMMAND_STATUS_OK;
+        }
+    }
+    else
+    {
+        LOG_ERROR(DEVF_FMT "Modbus Frame send failed",
+                  bus_context->bus, device.slave, device.address, device.function);
+    }
+    bus_block_write_reply(bus_context, block, status, retries);
+
+    if (status == COMMAND_STATUS_OK)
+    {
+        periodic_write_through(bus_context, device.slave, device.function, device.address, block->quantity, block->data);
+    }
+}
+
+//
+// Commands
+//
+
+static void process_read_command(struct bus_context *bus_context, struct m_command *command)
+{
+    uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
+    struct modbus_frame rx_frame;
+
+    struct m_device device = command->device;
+    size_t tx_frame_size = modbus_create_read_frame(
+        device.function,
+        device.slave,
+        device.address,
+        tx_frame,
+        sizeof(tx_frame));
+    if (tx_frame_size == 0)
+    {
+        LOG_ERROR(DEVF_FMT "Modbus Frame creation failed",
+                  bus_context->bus, device.slave, device.address, device.function);
+        return;
+    }
+
+    // Set reply in case of failure
+    struct m_command reply = {
+        .type = MESSAGE_COMMAND_READ_REPLY,
+        .seq = command->seq,
+        .device = device,
+        .msg.read_reply.done = false,
+        .msg.read_reply.data = 0,
+        .msg.read_reply.status = COMMAND_STATUS_FAILED,
+    };
+    uint16_t value;
+    if (send_modbus_frame_retry(
+            bus_context,
+            device.slave,
+            device.address,
+            tx_frame,
+            tx_frame_size,
+            &rx_frame,
+            &reply.msg.read_reply.retries) == MODBUS_COMPLETE)
+    {
+        if (rx_frame.function_code != device.function)
+        {
+            LOG_ERROR(DEVF_FMT "Modbus Frame wrong function code %02X",
+                      bus_context->bus, device.slave, device.address, device.function,
+                      rx_frame.function_code);
+        }
+        // Same representation as periodic reads, so cached and bus reads agree
+        else if (!modbus_read_frame_value(device.function, device.address, rx_frame.data, rx_frame.data_size, &value))
+        {
+            LOG_ERROR(DEVF_FMT "Error Modbus Frame Data size %u",
+                      bus_context->bus, device.slave, device.address, device.function,
+                      rx_frame.data_size);
+        }
+        else
+        {
+            reply.msg.read_reply.done = true;
+            reply.msg.read_reply.data = value;
+            reply.msg.read_reply.status = COMMAND_STATUS_OK;
+        }
+    }
+    else
+    {
+        LOG_ERROR(DEVF_FMT "Modbus Frame send failed",
+                  bus_context->bus, device.slave, device.address, device.function);
+    }
+    if (!xQueueSend(host_command_queue, &reply, FREERTOS_NO_WAIT))
+    {
+        LOG_ERROR("Bus %u could not send read reply to queue, queue full!", bus_context->bus);
+    }
+
+    bus_pending_fanout(bus_context, command, &reply);
+}
 
-#include "macrologger.h"
+static void process_write_command(struct bus_context *bus_context, struct m_command *command)
+{
+    uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
+    struct modbus_frame rx_frame;
+    struct bus_write_batch batch;
+    bool done = false;
+    uint8_t retries = 0;
 
-#include "bus.h"
-#include "host.h"
-#include "utils.h"
+    struct m_device device = command->device;
+    bus_write_batch_collect(bus_context, command, &batch);
+    if (batch.commands_len > 1)
+    {
+        LOG_DEBUG(DEVF_FMT "Write Batch - Start: %u, Quantity: %u, Commands: %u",
+                  bus_context->bus, device.slave, device.address, device.function,
+                  batch.address, batch.quantity, (unsigned int)batch.commands_len);
+    }
 
-char *name[COUNT_PIO_UARTS] = {
-    "Bus 0",
-    "Bus 1",
-    "Bus 2",
-    "Bus 3",
-    "Bus 4",
-};
+    size_t tx_frame_size = bus_write_batch_frame(&batch, &device, tx_frame, sizeof(tx_frame));
+    if (tx_frame_size == 0)
+    {
+        LOG_ERROR(DEVF_FMT "Modbus Frame creation failed",
+                  bus_context->bus, device.slave, device.address, device.function);
+    }
+    else if (send_modbus_frame_retry(
+                 bus_context,
+                 device.slave,
+                 batch.address,
+                 tx_frame,
+                 tx_frame_size,
+                 &rx_frame,
+                 &retries) == MODBUS_COMPLETE)
+    {
+        // A batch may be sent with a different function than the one requested
+        if (rx_frame.function_code != tx_frame[1])
+        {
+            LOG_ERROR(DEVF_FMT "Modbus Frame wrong function code %02X",
+                      bus_context->bus, device.slave, device.address, device.function,
+                      rx_frame.function_code);
+        }
+        else
+        {
+            done = true;
+        }
+    }
+    else
+    {
+        LOG_ERROR(DEVF_FMT "Modbus Frame send failed",
+                  bus_context->bus, device.slave, device.address, device.function);
+    }
 
-static struct bus_context *bus_contexts[COUNT_PIO_UARTS] = {NULL};
+    if (done)
+    {
+        uint8_t data[BUS_WRITE_BATCH_SIZE * 2];
+        bus_write_batch_data(&batch, device.function, data);
+        periodic_write_through(bus_context, device.slave, device.function, batch.address, batch.quantity, data);
+    }
+
+    // Every command of the batch gets its own reply, even the ones collapsed into a later write
+    for (size_t i = 0; i < batch.commands_len; i++)
+    {
+        const struct m_command *batched = &batch.commands[i];
+        struct m_command reply = {
+            .type = MESSAGE_COMMAND_WRITE_REPLY,
+            .seq = batched->seq,
+            .device = batched->device,
+            .msg.write_reply.done = done,
+            .msg.write_reply.data = done ? batched->msg.write.data : 0,
+            .msg.write_reply.status = done ? COMMAND_STATUS_OK : COMMAND_STATUS_FAILED,
+            .msg.write_reply.retries = retries,
+        };
+        if (!xQueueSend(host_command_queue, &reply, FREERTOS_NO_WAIT))
+        {
+            LOG_ERROR("Bus %u could not send write reply to queue, queue full!", bus_context->bus);
+        }
+    }
+}
 
-static bool send_modbus_frame(uint8_t bus, struct pio_uart *uart, uint8_t slave, uint8_t address, uint8_t *tx_frame, size_t frame_size, struct modbus_frame *rx_frame)
+/**
+ * Write the same coil/register of every slave. Done means the frame was sent, no slave confirms it.
+ */
+static void process_broadcast_command(struct bus_context *bus_context, struct m_command *command)
 {
-    struct modbus_parser parser;
-    uint8_t read_byte = 0xaa;
-    TickType_t last_timeout = 0;
+    uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
 
-#ifdef BUS_DEBUG_MODBUS_TX_FRAME
-    LOG_DEBUG(DEV_FMT "Modbus Tx Frame: %s",
-              bus, slave, address, to_hex_string(tx_frame, frame_size));
-#endif
+    struct m_device device = command->device;
+    uint16_t value = command->msg.write.data;
+    struct m_command reply = {
+        .type = MESSAGE_COMMAND_BROADCAST_REPLY,
+        .seq = command->seq,
+        .device = device,
+        .msg.write_reply.done = false,
+        .msg.write_reply.data = 0,
+        .msg.write_reply.status = COMMAND_STATUS_FAILED,
+        .msg.write_reply.retries = 0,
+    };
 
-    pio_uart_rx_flush(uart);                                   // Flush any remaining byte in the UART RX buffer
-    pio_uart_write_bytes_blocking(uart, tx_frame, frame_size); // Write the frame to the UART
+    size_t tx_frame_size = modbus_create_write_frame(
+        device.function, MODBUS_BROADCAST_ADDRESS, device.address, value, tx_frame, sizeof(tx_frame));
+    if (tx_frame_size == 0)
+    {
+        LOG_ERROR(DEVF_FMT "Modbus Frame creation failed",
+                  bus_context->bus, device.slave, device.address, device.function);
+    }
+    else
+    {
+        send_modbus_broadcast(bus_context, device.address, tx_frame, tx_frame_size);
+        reply.msg.write_reply.done = true;
+        reply.msg.write_reply.data = value;
+        reply.msg.write_reply.status = COMMAND_STATUS_OK;
 
-    // Release the CPU until the frame is sent to UART and possibly the response is available
-    vTaskDelay(pdMS_TO_TICKS(BUS_DELAY_WRITE_READ));
+        // Same wire form as a single write batch
+        uint8_t data[2];
+        if (device.function == MODBUS_FUNCTION_WRITE_SINGLE_COIL)
+        {
+            data[0] = value ? 1 : 0;
+        }
+        else
+        {
+            data[0] = value >> 8;
+            data[1] = value & 0xFF;
+        }
+        periodic_write_through(bus_context, MODBUS_BROADCAST_ADDRESS, device.function, device.address, 1, data);
+    }
+    if (!xQueueSend(host_command_queue, &reply, FREERTOS_NO_WAIT))
+    {
+        LOG_ERROR("Bus %u could not send broadcast reply to queue, queue full!", bus_context->bus);
+    }
+}
 
-    modbus_parser_reset(&parser); // Reset the parser
+//
+// Read-modify-write commands
+// Mask Write Register (0x16) and Read/Write Multiple Registers (0x17) take a single transaction. Slaves that
+// answer them with Illegal Function are flagged and get a holding register read and write instead, which is
+// not atomic: another master may write the register in between.
+//
 
-    TickType_t timeout_max_tick = NEXT_TIMEOUT(BUS_TIMEOUT_RESPONSE); // Start timeout counter
+/**
+ * If the slave doesn't implement the function of the request.
+ */
+static bool bus_result_illegal_function(enum modbus_result result, const struct modbus_frame *rx_frame)
+{
+    return result == MODBUS_ERROR_EXCEPTION && rx_frame->data_size > 0 &&
+           rx_frame->data[0] == MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+}
 
-    while (true)
+/**
+ * Send a request and check the reply function, retries are added to 'retries'.
+ */
+static enum modbus_result bus_transaction(struct bus_context *bus_context,
+                                          uint8_t slave,
+                                          uint16_t address,
+                                          const uint8_t *tx_frame,
+                                          size_t tx_frame_size,
+                                          struct modbus_frame *rx_frame,
+                                          uint8_t *retries)
+{
+    if (tx_frame_size == 0)
+    {
+        LOG_ERROR(DEV_FMT "Modbus Frame creation failed", bus_context->bus, slave, address);
+        return MODBUS_ERROR_LENGTH;
+    }
+
+    uint8_t attempt_retries = 0;
+    enum modbus_result result = send_modbus_frame_retry(bus_context, slave, address, tx_frame, tx_frame_size,
+                                                        rx_frame, &attempt_retries);
+    *retries += attempt_retries;
+    if (result == MODBUS_COMPLETE && rx_frame->function_code != tx_frame[1])
+    {
+        LOG_ERROR(DEV_FMT "Modbus Frame wrong function code %02X",
+                  bus_context->bus, slave, address, rx_frame->function_code);
+        return MODBUS_ERROR_FUNCTION;
+    }
+    return result;
+}
+
+/**
+ * Read a single holding register, for the emulated read-modify-write.
+ */
+static enum modbus_result bus_register_read(struct bus_context *bus_context,
+                                            uint8_t slave,
+                                            uint16_t address,
+                                            uint16_t *value,
+                                            uint8_t *retries)
+{
+    uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
+    struct modbus_frame rx_frame;
+
+    size_t tx_frame_size = modbus_create_read_holding_registers_frame(slave, address, 1, tx_frame, sizeof(tx_frame));
+    enum modbus_result result = bus_transaction(bus_context, slave, address, tx_frame, tx_frame_size, &rx_frame, retries);
+    if (result == MODBUS_COMPLETE)
+    {
+        if (rx_frame.data_size != 2)
+        {
+            return MODBUS_ERROR_LENGTH;
+        }
+        *value = rx_frame.data[0] << 8 | rx_frame.data[1];
+    }
+    return result;
+}
+
+/**
+ * Write a single holding register, for the emulated read-modify-write.
+ */
+static enum modbus_result bus_register_write(struct bus_context *bus_context,
+                                             uint8_t slave,
+                                             uint16_t address,
+                                             uint16_t value,
+                                             uint8_t *retries)
+{
+    uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
+    struct modbus_frame rx_frame;
+
+    size_t tx_frame_size = modbus_create_write_multiple_registers_frame(slave, address, &value, 1, tx_frame, sizeof(tx_frame));
+    return bus_transaction(bus_context, slave, address, tx_frame, tx_frame_size, &rx_frame, retries);
+}
+
+/**
+ * Update the periodic read of a written holding register.
+ */
+static void periodic_register_write_through(struct bus_context *bus_context, uint8_t slave, uint16_t address, uint16_t value)
+{
+    uint8_t data[2] = {value >> 8, value & 0xFF};
+    periodic_write_through(bus_context, slave, MODBUS_FUNCTION_WRITE_HOLDING_REGISTERS, address, 1, data);
+}
+
+static void process_mask_write_command(struct bus_context *bus_context, struct m_command *command)
+{
+    uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
+    struct modbus_frame rx_frame;
+    enum modbus_result result = MODBUS_ERROR_FUNCTION;
+
+    struct m_device device = command->device;
+    struct bus_slave *bus_slave = bus_get_slave(bus_context, device.slave);
+    uint16_t and_mask = command->msg.mask_write.and_mask;
+    uint16_t or_mask = command->msg.mask_write.or_mask;
+    bool emulate = bus_slave != NULL && bus_slave->no_mask_write;
+
+    // Set reply in case of failure
+    struct m_command reply = {
+        .type = MESSAGE_COMMAND_MASK_WRITE_REPLY,
+        .seq = command->seq,
+        .device = device,
+        .msg.write_reply.done = false,
+        .msg.write_reply.data = 0,
+        .msg.write_reply.status = COMMAND_STATUS_FAILED,
+        .msg.write_reply.retries = 0,
+    };
+
+    uint16_t value = 0;
+    bool value_known = false;
+    if (!emulate)
     {
-        if (!pio_uart_read_bytes(uart, &read_byte, 1)) // If there is no byte available, wait or timeout
+        size_t tx_frame_size = modbus_create_mask_write_register_frame(
+            device.slave, device.address, and_mask, or_mask, tx_frame, sizeof(tx_frame));
+        result = bus_transaction(bus_context, device.slave, device.address, tx_frame, tx_frame_size,
+                                 &rx_frame, &reply.msg.write_reply.retries);
+        if (bus_result_illegal_function(result, &rx_frame))
         {
-            if (IS_EXPIRED(timeout_max_tick)) // Check if the timeout has expired
+            LOG_INFO(DEV_FMT "Mask Write Register not supported, using read then write",
+                     bus_context->bus, device.slave, device.address);
+            if (bus_slave != NULL)
             {
-                // FIXME: This contention to print timeout is not doing anything useful.
-                // This function will print several timeouts for each time it is called
-                if (IS_EXPIRED(last_timeout)) // Check if we need to print a timeout message
-                {
-                    LOG_ERROR(DEV_FMT "Timeout", bus, slave, address);
-                    last_timeout = NEXT_TIMEOUT(BUS_DELAY_TIMEOUT_MSG);
-                }
-                // Go to next module if timeout
-                break; // while, process next module
+                bus_slave->no_mask_write = true;
             }
-            // Release CPU until some byte arrive in the UART
-            vTaskDelay(pdMS_TO_TICKS(1)); // Minimum delay
+            emulate = true;
+        }
+        else if (result == MODBUS_COMPLETE)
+        {
+            // The reply is an echo of the request, the new value is unknown and data stays 0.
+            // Poll it now, so the host gets it as a change.
+            periodic_schedule_register_now(bus_context, device.slave, device.address);
+        }
+    }
+    if (emulate)
+    {
+        result = bus_register_read(bus_context, device.slave, device.address, &value, &reply.msg.write_reply.retries);
+        if (result == MODBUS_COMPLETE)
+        {
+            value_known = true;
+            value = (value & and_mask) | (or_mask & ~and_mask);
+            result = bus_register_write(bus_context, device.slave, device.address, value, &reply.msg.write_reply.retries);
+        }
+    }
 
-            continue; // while, process next module
+    if (result == MODBUS_COMPLETE)
+    {
+        reply.msg.write_reply.done = true;
+        reply.msg.write_reply.status = COMMAND_STATUS_OK;
+        if (value_known)
+        {
+            reply.msg.write_reply.data = value;
+            periodic_register_write_through(bus_context, device.slave, device.address, value);
         }
+    }
+    else
+    {
+        LOG_ERROR(DEVF_FMT "Mask Write Register failed",
+                  bus_context->bus, device.slave, device.address, device.function);
+    }
+    if (!xQueueSend(host_command_queue, &reply, FREERTOS_NO_WAIT))
+    {
+        LOG_ERROR("Bus %u could not send mask write reply to queue, queue full!", bus_context->bus);
+    }
+}
+
+static void process_read_write_command(struct bus_context *bus_context, struct m_command *command)
+{
+    uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
+    struct modbus_frame rx_frame;
+    enum modbus_result result = MODBUS_ERROR_FUNCTION;
+
+    struct m_device device = command->device;
+    struct bus_slave *bus_slave = bus_get_slave(bus_context, device.slave);
+    uint16_t write_address = command->msg.read_write.write_address;
+    uint16_t data = command->msg.read_write.data;
+    bool emulate = bus_slave != NULL && bus_slave->no_read_write;
+
+    // Set reply in case of failure
+    struct m_command reply = {
+        .type = MESSAGE_COMMAND_READ_WRITE_REPLY,
+        .seq = command->seq,
+        .device = device,
+        .msg.read_reply.done = false,
+        .msg.read_reply.data = 0,
+        .msg.read_reply.status = COMMAND_STATUS_FAILED,
+        .msg.read_reply.retries = 0,
+    };
 
-        // Process parser result
-        enum modbus_result parser_status = modbus_parser_process_byte(&parser, rx_frame, read_byte);
-        if (parser_status >= MODBUS_ERROR_SLAVE)
+    uint16_t value = 0;
+    bool written = false;
+    if (!emulate)
+    {
+        size_t tx_frame_size = modbus_create_read_write_multiple_registers_frame(
+            device.slave, device.address, 1, write_address, &data, 1, tx_frame, sizeof(tx_frame));
+        result = bus_transaction(bus_context, device.slave, device.address, tx_frame, tx_frame_size,
+                                 &rx_frame, &reply.msg.read_reply.retries);
+        if (bus_result_illegal_function(result, &rx_frame))
         {
-            LOG_ERROR(DEV_FMT "Error %u parsing Modbus Frame", bus, slave, address, parser_status);
-            break; // while, process next module
+            LOG_INFO(DEV_FMT "Read/Write Multiple Registers not supported, using write then read",
+                     bus_context->bus, device.slave, device.address);
+            if (bus_slave != NULL)
+            {
+                bus_slave->no_read_write = true;
+            }
+            emulate = true;
         }
-        else if (parser_status == MODBUS_COMPLETE)
+        else if (result == MODBUS_COMPLETE)
         {
-#ifdef BUS_DEBUG_MODBUS_RX_FRAME
-            LOG_DEBUG(DEV_FMT "Modbus Rx Frame: %s",
-                      bus, slave, address, to_hex_string(rx_frame->data, rx_frame->data_size));
-#endif
-            return true;
+            written = true;
+            if (rx_frame.data_size == 2)
+            {
+                value = rx_frame.data[0] << 8 | rx_frame.data[1];
+            }
+            else
+            {
+                result = MODBUS_ERROR_LENGTH;
+            }
         }
     }
-    return false;
+    if (emulate)
+    {
+        // Same order as the slave would do, the write goes first
+        result = bus_register_write(bus_context, device.slave, write_address, data, &reply.msg.read_reply.retries);
+        if (result == MODBUS_COMPLETE)
+        {
+            written = true;
+            result = bus_register_read(bus_context, device.slave, device.address, &value, &reply.msg.read_reply.retries);
+        }
+    }
+
+    if (written)
+    {
+        periodic_register_write_through(bus_context, device.slave, write_address, data);
+    }
+    if (result == MODBUS_COMPLETE)
+    {
+        reply.msg.read_reply.done = true;
+        reply.msg.read_reply.status = COMMAND_STATUS_OK;
+        reply.msg.read_reply.data = value;
+    }
+    else
+    {
+        LOG_ERROR(DEVF_FMT "Read/Write Multiple Registers failed",
+                  bus_context->bus, device.slave, device.address, device.function);
+    }
+    if (!xQueueSend(host_command_queue, &reply, FREERTOS_NO_WAIT))
+    {
+        LOG_ERROR("Bus %u could not send read write reply to queue, queue full!", bus_context->bus);
+    }
 }
 
-static void bus_task(void *arg)
+//
+// Raw passthrough
+// The host built PDU goes as is, so the response can't be parsed by its function: it ends at the
+// expected size, or at the bus silence after it.
+//
+
+/**
+ * Send a frame and receive the response whatever its function, in the bus rx_buffer.
+ * response_size is the expected response size, 0 if unknown.
+ */
+static enum modbus_result send_modbus_raw(struct bus_context *bus_context,
+                                          uint8_t slave,
+                                          const uint8_t *tx_frame,
+                                          size_t frame_size,
+                                          size_t response_size,
+                                          size_t *rx_size)
 {
-    struct bus_context *bus_context = arg;
+    struct pio_uart *uart = bus_context->pio_uart;
+    struct bus_slave *bus_slave = bus_get_slave(bus_context, slave);
+    uint8_t *rx_frame = bus_context->rx_buffer;
+    size_t received = 0;
+
+    bus_transmit(bus_context, slave, 0, tx_frame, frame_size);
+
+    uint32_t timeout_us = bus_response_timeout_us(bus_context, bus_slave, response_size);
+    TickType_t timeout_max_tick = xTaskGetTickCount() + pdMS_TO_TICKS((timeout_us + 999) / 1000) + 1;
+    // Gaps inside a frame are below 1.5 characters, a tick over the 3.5 characters silence ends it
+    TickType_t silence_ticks = pdMS_TO_TICKS((bus_silence_time_us(bus_context) + 999) / 1000) + 1;
+    while (received < sizeof(bus_context->rx_buffer) && (response_size == 0 || received < response_size))
+    {
+        TickType_t wait = silence_ticks;
+        if (received == 0)
+        {
+            TickType_t now = xTaskGetTickCount();
+            if (!TICK_BEFORE(now, timeout_max_tick))
+            {
+                break;
+            }
+            wait = timeout_max_tick - now;
+        }
+        size_t read_len = pio_uart_read_bytes_timeout(uart, rx_frame + received, sizeof(bus_context->rx_buffer) - received, wait);
+        if (read_len == 0 && received > 0)
+        {
+            break; // Silence after the response
+        }
+        received += read_len;
+    }
+    bus_context->last_frame_us = time_us_32();
+
+    enum modbus_result result = MODBUS_COMPLETE;
+    if (received == 0)
+    {
+        bus_slave_rtt_timeout(bus_slave);
+        result = MODBUS_ERROR_TIMEOUT;
+    }
+    else if (received < 4) // slave, function, CRC (2)
+    {
+        result = MODBUS_ERROR_LENGTH;
+    }
+    else if (rx_frame[0] != slave)
+    {
+        result = MODBUS_ERROR_SLAVE;
+    }
+    else if (compute_crc(rx_frame, received) != 0) // The CRC over a frame and its own CRC is 0
+    {
+        result = MODBUS_ERROR_CRC;
+    }
+    bus_slave_health_update(bus_context, bus_slave, result);
+    if (result != MODBUS_COMPLETE)
+    {
+        LOG_ERROR(DEV_FMT "Error %u receiving raw Modbus Frame, %u bytes",
+                  bus_context->bus, slave, 0, result, (unsigned int)received);
+    }
+    *rx_size = received;
+    return result;
+}
 
+static void process_raw_command(struct bus_context *bus_context, const struct m_raw *raw)
+{
     uint8_t tx_frame[BUS_MODBUS_FRAME_BUFFER_SIZE];
-    struct modbus_frame rx_frame;
-    size_t tx_frame_size = 0;
+
+    // slave, PDU, CRC (2)
+    size_t tx_frame_size = raw->pdu_size + 3;
+    if (raw->pdu_size == 0 || tx_frame_size > sizeof(tx_frame))
+    {
+        LOG_ERROR(DEV_FMT "Raw PDU size %u invalid", bus_context->bus, raw->slave, 0, raw->pdu_size);
+        bus_raw_reply(bus_context, raw, COMMAND_STATUS_FAILED, MODBUS_ERROR_LENGTH, NULL, 0);
+        return;
+    }
+    tx_frame[0] = raw->slave;
+    memcpy(tx_frame + 1, raw->pdu, raw->pdu_size);
+    uint16_t crc = compute_crc(tx_frame, raw->pdu_size + 1);
+    tx_frame[raw->pdu_size + 1] = crc & 0xFF;
+    tx_frame[raw->pdu_size + 2] = crc >> 8;
+
+    // No slave answers a broadcast, it is done once sent
+    if (raw->slave == MODBUS_BROADCAST_ADDRESS)
+    {
+        send_modbus_broadcast(bus_context, 0, tx_frame, tx_frame_size);
+        bus_raw_reply(bus_context, raw, COMMAND_STATUS_OK, MODBUS_COMPLETE, NULL, 0);
+        return;
+    }
+
+    size_t rx_size = 0;
+    size_t response_size = raw->response_size ? raw->response_size + 3 : 0;
+    enum modbus_result result = send_modbus_raw(bus_context, raw->slave, tx_frame, tx_frame_size, response_size, &rx_size);
+    if (result == MODBUS_COMPLETE && rx_size - 3 > M_RAW_PDU_SIZE)
+    {
+        LOG_ERROR(DEV_FMT "Raw response PDU too long for the host, %u bytes",
+                  bus_context->bus, raw->slave, 0, (unsigned int)(rx_size - 3));
+        result = MODBUS_ERROR_LENGTH;
+    }
+    if (result == MODBUS_COMPLETE)
+    {
+        bus_raw_reply(bus_context, raw, COMMAND_STATUS_OK, result, bus_context->rx_buffer + 1, rx_size - 3);
+    }
+    else
+    {
+        bus_raw_reply(bus_context, raw, COMMAND_STATUS_FAILED, result, NULL, 0);
+    }
+}
+
+static void process_command(struct bus_context *bus_context, struct bus_command *bus_command)
+{
+    struct m_command *command = &bus_command->command;
+    struct m_device device = command->device;
+    LOG_DEBUG(DEVF_FMT "Processing Command - Type: %u, Seq: %u",
+              bus_context->bus, device.slave, device.address, device.function,
+              command->type, command->seq);
+
+    switch (command->type)
+    {
+    case MESSAGE_COMMAND_READ:
+        process_read_command(bus_context, command);
+        break;
+    case MESSAGE_COMMAND_WRITE:
+        process_write_command(bus_context, command);
+        break;
+    case MESSAGE_COMMAND_BROADCAST:
+        process_broadcast_command(bus_context, command);
+        break;
+    case MESSAGE_COMMAND_MASK_WRITE:
+        process_mask_write_command(bus_context, command);
+        break;
+    case MESSAGE_COMMAND_READ_WRITE:
+        process_read_write_command(bus_context, command);
+        break;
+    case MESSAGE_BLOCK_READ:
+        process_block_read(bus_context, bus_command->block);
+        break;
+    case MESSAGE_BLOCK_WRITE:
+        process_block_write(bus_context, bus_command->block);
+        break;
+    case MESSAGE_RAW:
+        process_raw_command(bus_context, bus_command->block);
+        break;
+    default:
+        LOG_ERROR(DEVF_FMT "Modbus Frame invalid command type %u",
+                  bus_context->bus, device.slave, device.address, device.function,
+                  command->type);
+        break;
+    }
+    vPortFree(bus_command->block);
+}
+
+static void bus_task(void *arg)
+{
+    struct bus_context *bus_context = arg;
 
     // Update baud if present
     if (bus_context->baudrate > 0)
@@ -99,205 +2342,141 @@ static void bus_task(void *arg)
     // Wait until all buses are configured and replied to the host
     vTaskDelay(pdMS_TO_TICKS(BUS_START_DELAY));
 
+    periodic_schedule_init(bus_context);
+
     for (;;) // Task infinite loop
     {
-        // Handle Periodic reads
-        // Iterate over all entries, and process them sequentially
-        for (size_t i = 0; i < bus_context->periodic_reads_len; i++)
+        // Sleep until the next periodic group is due, or a command arrives
+        TickType_t wait = portMAX_DELAY;
+        struct bus_periodic_group *group = periodic_schedule_peek(bus_context);
+        if (group != NULL)
         {
-            struct bus_periodic_read *p_read = &bus_context->periodic_reads[i];
-            if (IS_EXPIRED(p_read->next_run))
-            {
-#ifdef BUS_DEBUG_PERIODIC_READS
-                LOG_DEBUG(DEVF_FMT "Periodic Read",
-                          bus_context->bus, p_read->slave, p_read->address, p_read->function);
-#endif
-                p_read->next_run = NEXT_TIMEOUT(bus_context->periodic_interval); // Update the next run right away, so we don't have a drift
-
-                tx_frame_size = modbus_create_read_frame(
-                    p_read->function,
-                    p_read->slave,
-                    p_read->address,
-                    tx_frame,
-                    sizeof(tx_frame));
-                if (tx_frame_size == 0)
-                {
-                    LOG_ERROR(DEVF_FMT "Modbus Frame creation failed",
-                              bus_context->bus, p_read->slave, p_read->address, p_read->function);
-                }
-                else
-                {
-                    if (send_modbus_frame(
-                            bus_context->bus,
-                            bus_context->pio_uart,
-                            p_read->slave,
-                            p_read->address,
-                            tx_frame,
-                            tx_frame_size,
-                            &rx_frame))
-                    {
-                        if (rx_frame.function_code != p_read->function)
-                        {
-                            LOG_ERROR(DEVF_FMT "Modbus Frame wrong function code %02X",
-                                      bus_context->bus, p_read->slave, p_read->address, p_read->function,
-                                      rx_frame.function_code);
-                        }
-                        else
-                        {
-                            process_periodic_reply(bus_context->bus, p_read, &rx_frame);
-                        }
-                    }
-                }
-            }
-            taskYIELD();
+            TickType_t now = xTaskGetTickCount();
+            wait = TICK_BEFORE(now, group->next_run) ? group->next_run - now : FREERTOS_NO_WAIT;
         }
 
         //
         // Handle Commands
-        struct m_command command;
-        if (xQueueReceive(bus_context->command_queue, &command, FREERTOS_NO_WAIT))
+        // Commands have priority over periodic reads, drain all queued commands before polling resumes
+        struct bus_command command;
+        size_t commands_processed = 0;
+        while (bus_pending_fill(bus_context, wait))
         {
-            struct m_device device = command.device;
-            LOG_DEBUG(DEVF_FMT "Processing Command - Type: %u, Seq: %u",
-                      bus_context->bus, device.slave, device.address, device.function,
-                      command.type, command.seq);
+            bus_pending_pop(bus_context, &command);
+            // A write popped is no longer pending, but the cache doesn't have its effect until it is done
+            taskENTER_CRITICAL();
+            bus_context->running_write = bus_command_is_write(&command.command);
+            bus_context->running_slave = command.command.device.slave;
+            taskEXIT_CRITICAL();
+            process_command(bus_context, &command);
+            bus_context->running_write = false;
+            wait = FREERTOS_NO_WAIT;
 
-            switch (command.type)
+            // Starvation guard, let a due periodic group run between long command bursts
+            if (BUS_COMMAND_MAX_BURST && ++commands_processed >= BUS_COMMAND_MAX_BURST)
             {
-            case MESSAGE_COMMAND_READ:
-                tx_frame_size = modbus_create_read_frame(
-                    device.function,
-                    device.slave,
-                    device.address,
-                    tx_frame,
-                    sizeof(tx_frame));
-                break;
-            case MESSAGE_COMMAND_WRITE:
-                tx_frame_size = modbus_create_write_frame(
-                    device.function,
-                    device.slave,
-                    device.address,
-                    command.msg.write.data,
-                    tx_frame,
-                    sizeof(tx_frame));
-                break;
-            default:
-                tx_frame_size = 0;
-                LOG_ERROR(DEVF_FMT "Modbus Frame invalid command type %u",
-                          bus_context->bus, device.slave, device.address, device.function,
-                          command.type);
                 break;
             }
-            if (tx_frame_size == 0)
+        }
+
+        //
+        // Handle Periodic reads
+        // Run the group with the earliest deadline, if it is due.
+        // A single transaction, so queued commands are checked again right after it.
+        group = periodic_schedule_peek(bus_context);
+        TickType_t now = xTaskGetTickCount();
+        if (group != NULL && !TICK_BEFORE(now, group->next_run))
+        {
+            struct bus_slave *bus_slave = bus_get_slave(bus_context, group->slave);
+            if (bus_slave != NULL && bus_slave->offline && TICK_BEFORE(now, bus_slave->next_probe))
             {
-                LOG_ERROR(DEVF_FMT "Modbus Frame creation failed",
-                          bus_context->bus, device.slave, device.address, device.function);
+                // Offline slave, don't hold the bus until its next probe
+                periodic_schedule_defer(bus_context, group, bus_slave->next_probe);
             }
             else
             {
-                struct m_command reply = {
-                    .device = device,
-                    .seq = command.seq,
-                };
-                // Set reply in case of failure
-                switch (command.type)
-                {
-                case MESSAGE_COMMAND_READ:
-                    reply.type = MESSAGE_COMMAND_READ_REPLY;
-                    reply.msg.read_reply.done = false;
-                    reply.msg.read_reply.data = 0;
-                    break;
-                case MESSAGE_COMMAND_WRITE:
-                    reply.type = MESSAGE_COMMAND_WRITE_REPLY;
-                    reply.msg.write_reply.done = false;
-                    break;
-                }
-                if (send_modbus_frame(
-                        bus_context->bus,
-                        bus_context->pio_uart,
-                        device.slave,
-                        device.address,
-                        tx_frame,
-                        tx_frame_size,
-                        &rx_frame))
-                {
-                    if (rx_frame.function_code != device.function)
-                    {
-                        LOG_ERROR(DEVF_FMT "Modbus Frame wrong function code %02X",
-                                  bus_context->bus, device.slave, device.address, device.function,
-                                  rx_frame.function_code);
-                    }
-                    else
-                    {
-                        switch (command.type)
-                        {
-                        case MESSAGE_COMMAND_READ:
-                            reply.msg.read_reply.done = true;
-                            // FIXME: This is probably wrong, MSB is 0 not 1.
-                            reply.msg.read_reply.data = rx_frame.data[1] << 8 | rx_frame.data[0];
-                            break;
-                        case MESSAGE_COMMAND_WRITE:
-                            reply.msg.write_reply.done = true;
-                            reply.msg.write_reply.data = command.msg.write.data;
-                            printf("Data: %04X\n", reply.msg.write_reply.data);
-                            break;
-                        }
-                    }
-                }
-                else
-                {
-                    LOG_ERROR(DEVF_FMT "Modbus Frame send failed",
-                              bus_context->bus, device.slave, device.address, device.function);
-                }
-                if (!xQueueSend(host_command_queue, &reply, FREERTOS_NO_WAIT))
-                {
-                    LOG_ERROR("Bus %u could not send read reply to queue, queue full!", bus_context->bus);
-                }
+                process_periodic_group(bus_context, group);
+                periodic_schedule_next(bus_context, group);
             }
         }
-
-        vTaskDelay(pdMS_TO_TICKS(1)); // Minimum delay
     }
 }
 
-void process_periodic_reply(uint8_t bus, struct bus_periodic_read *p_read, struct modbus_frame *frame)
+void process_periodic_reply(struct bus_context *bus_context, struct bus_periodic_group *group, struct modbus_frame *frame)
 {
-    if (frame->data_size != 2)
+    uint16_t expected_size = modbus_function_return_size(group->function, group->quantity);
+    if (frame->data_size != expected_size)
     {
-        LOG_ERROR("Error Modbus Frame Data size must be equal to 2!");
+        LOG_ERROR(DEVF_FMT "Error Modbus Frame Data size %u, expected %u",
+                  bus_context->bus, group->slave, group->address, group->function,
+                  frame->data_size, expected_size);
         return;
     }
 
-    struct m_command reply = {0};
+    // Split the group reply in each periodic read
+    bool changed = false;
+    for (size_t i = 0; i < group->reads_len; i++)
+    {
+        struct bus_periodic_read *p_read = &bus_context->periodic_reads[group->reads_index + i];
 
-    uint16_t data = frame->data[0] << 8 | frame->data[1];
-    reply.device.bus = bus;
-    reply.device.slave = p_read->slave;
-    reply.device.function = p_read->function;
-    reply.device.address = p_read->address;
-    reply.msg.periodic_change.data = data;
-    reply.msg.periodic_change.data_mask = data ^ p_read->last_data;
-    // If there is any change, send it to the host
-    if (reply.msg.periodic_change.data_mask)
+        // The first read of a point is not a change of the input
+        bool valid = p_read->valid;
+        if (periodic_read_update(bus_context, p_read, periodic_read_extract(group, p_read, frame)) && valid)
+        {
+            changed = true;
+        }
+    }
+    // Inputs change in bursts, poll faster for a while
+    if (changed)
     {
-#ifdef BUS_DEBUG_PERIODIC_READS
-        LOG_INFO(DEVF_FMT "Change detected %s",
-                 bus, reply.device.slave, reply.device.address, reply.device.function,
-                 to_bin_hex_string((uint8_t *)&reply.msg.periodic_change.data, 2));
-#endif
-        if (!xQueueSend(host_change_queue, &reply, FREERTOS_NO_WAIT))
+        periodic_schedule_change(bus_context, group);
+    }
+}
+
+bool bus_cache_read(uint8_t bus, const struct m_device *device, uint16_t max_age, uint16_t *data)
+{
+    struct bus_context *bus_context = bus_get_context(bus);
+    if (bus_context == NULL)
+    {
+        return false;
+    }
+    // Queued commands are not known until the bus task moves them to pending, any of them may be a write
+    if (uxQueueMessagesWaiting(bus_context->command_queue) > 0)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < bus_context->periodic_reads_len; i++)
+    {
+        struct bus_periodic_read *p_read = &bus_context->periodic_reads[i];
+        // A wider value doesn't answer a single register read
+        if (p_read->slave == device->slave &&
+            p_read->function == device->function &&
+            p_read->address == device->address &&
+            periodic_read_width(p_read) == 1)
         {
-            LOG_ERROR("Bus %u could not send change to queue, queue full!", bus);
+            bool fresh = false;
+            // The bus task updates the cache and the pending commands from the other core.
+            // A write to the slave not done yet may change the value, the read must go after it.
+            taskENTER_CRITICAL();
+            if (p_read->valid && xTaskGetTickCount() - p_read->updated_at <= pdMS_TO_TICKS(max_age) &&
+                !bus_pending_write(bus_context, device->slave))
+            {
+                *data = p_read->last_data;
+                fresh = true;
+            }
+            taskEXIT_CRITICAL();
+            return fresh;
         }
     }
-    // Copy new read values to the last_values array
-    p_read->last_data = reply.msg.periodic_change.data;
+    return false;
 }
 
 void bus_init(struct bus_context *bus_context)
 {
     bus_contexts[bus_context->bus] = bus_context;
 
+    build_periodic_groups(bus_context);
+
     xTaskCreateAffinitySet(bus_task,
                            name[bus_context->bus],
                            configMINIMAL_STACK_SIZE * 4,
@@ -309,5 +2488,5 @@ void bus_init(struct bus_context *bus_context)
 
 struct bus_context *bus_get_context(uint8_t bus)
 {
-    return bus_contexts[bus];
+    return bus < COUNT_PIO_UARTS ? bus_contexts[bus] : NULL;
 }
@@ -23,13 +23,40 @@ static volatile TickType_t next_heartbeat;
 
 QueueHandle_t host_change_queue;
 QueueHandle_t host_command_queue;
+QueueHandle_t host_message_queue;
 
 //
 // Messages
 //
 
-void handle_m_config_bus(const struct m_config_bus *msg)
+/**
+ * Queue a command to a bus, stamping its deadline on arrival so time spent queued counts.
+ * The block, if any, is owned by the bus task from now on.
+ */
+static void host_queue_command(struct bus_context *bus_context, const struct m_command *command, uint16_t ttl, void *block)
+{
+    struct bus_command bus_command = {
+        .command = *command,
+        .expires = ttl > 0,
+        .deadline = NEXT_TIMEOUT(ttl),
+        .block = block,
+    };
+    if (!xQueueSend(bus_context->command_queue, &bus_command, FREERTOS_NO_WAIT))
+    {
+        LOG_ERROR("Bus %u could not queue command, queue full!", bus_context->bus);
+        vPortFree(block);
+    }
+}
+
+void handle_m_config_bus(const struct m_config_bus *msg, uint8_t len)
 {
+    // periodic_reads_length comes from the host, it must match what was received
+    if (len < sizeof(struct m_config_bus) ||
+        sizeof(struct m_config_bus) + msg->periodic_reads_length * sizeof(struct m_periodic_read) != len)
+    {
+        LOG_ERROR("Config bus size doesn't match its payload, %u bytes!", len);
+        return;
+    }
     struct m_command reply = {0};
     reply.type = MESSAGE_CONFIG_BUS_REPLY;
     reply.msg.config_bus_reply.done = false;
@@ -61,19 +88,40 @@ void handle_m_config_bus(const struct m_config_bus *msg)
     bus_context->pio_uart = pio_uart;
     bus_context->baudrate = msg->baudrate;
     bus_context->bus = msg->bus;
-    bus_context->command_queue = xQueueCreate(HOST_QUEUE_LENGTH, sizeof(struct m_command));
+    bus_context->command_queue = xQueueCreate(HOST_QUEUE_LENGTH, sizeof(struct bus_command));
     bus_context->periodic_interval = msg->periodic_interval;
+    bus_context->periodic_max_gap = msg->periodic_max_gap;
+    bus_context->burst_interval = msg->burst_interval;
+    bus_context->burst_window = msg->burst_window;
+    bus_context->burst_slave = msg->burst_slave;
+    bus_context->retry_max = msg->retry_max;
+    if (bus_context->retry_max > BUS_RETRY_MAX)
+    {
+        LOG_ERROR("Bus %u retry max %u too high, using %u", msg->bus, msg->retry_max, BUS_RETRY_MAX);
+        bus_context->retry_max = BUS_RETRY_MAX;
+    }
+    bus_context->retry_backoff = msg->retry_backoff;
     bus_context->periodic_reads_len = msg->periodic_reads_length;
     for (size_t i = 0; i < bus_context->periodic_reads_len; i++)
     {
         struct bus_periodic_read *bus_pr = &bus_context->periodic_reads[i];
-        const struct m_device *msg_pr = &msg->periodic_reads[i];
+        const struct m_device *msg_pr = &msg->periodic_reads[i].device;
 
         bus_pr->slave = msg_pr->slave;
         bus_pr->function = msg_pr->function;
         bus_pr->address = msg_pr->address;
-        bus_pr->next_run = 0;
+        bus_pr->interval = msg->periodic_reads[i].interval ? msg->periodic_reads[i].interval : msg->periodic_interval;
+        bus_pr->type = msg->periodic_reads[i].type;
+        bus_pr->filter = msg->periodic_reads[i].filter;
+        bus_pr->filter_value = msg->periodic_reads[i].filter_value;
         bus_pr->last_data = 0;
+        bus_pr->reported = 0;
+        if (modbus_function_reads_bits(bus_pr->function) && bus_pr->type != PERIODIC_READ_TYPE_UINT16)
+        {
+            LOG_ERROR(DEVF_FMT "Periodic Read type %02X invalid for coils, using UINT16",
+                      msg->bus, bus_pr->slave, bus_pr->address, bus_pr->function, bus_pr->type);
+            bus_pr->type = PERIODIC_READ_TYPE_UINT16;
+        }
         LOG_INFO(DEVF_FMT "Periodic Read", msg->bus, bus_pr->slave, bus_pr->address, bus_pr->function);
     }
     bus_init(bus_context);
@@ -82,13 +130,178 @@ void handle_m_config_bus(const struct m_config_bus *msg)
     xQueueSend(host_command_queue, &reply, FREERTOS_NO_WAIT);
 }
 
-void handle_m_command(const struct m_command *msg)
+void handle_m_command(const struct m_command *msg, uint8_t len)
+{
+    if (len != sizeof(struct m_command))
+    {
+        LOG_ERROR("Command size doesn't match its payload, %u bytes!", len);
+        return;
+    }
+    struct bus_context *bus_context = bus_get_context(msg->device.bus);
+    if (bus_context == NULL)
+    {
+        LOG_ERROR("Bus %u not configured!", msg->device.bus);
+        return;
+    }
+
+    // Answer right away from the periodic reads cache, if the host accepts its age
+    if (msg->type == MESSAGE_COMMAND_READ && msg->msg.read.max_age > 0)
+    {
+        struct m_command reply = {
+            .type = MESSAGE_COMMAND_READ_REPLY,
+            .seq = msg->seq,
+            .device = msg->device,
+        };
+        uint16_t data;
+        if (bus_cache_read(msg->device.bus, &msg->device, msg->msg.read.max_age, &data))
+        {
+            reply.msg.read_reply.done = true;
+            reply.msg.read_reply.data = data;
+            reply.msg.read_reply.status = COMMAND_STATUS_OK;
+            xQueueSend(host_command_queue, &reply, FREERTOS_NO_WAIT);
+            return;
+        }
+    }
+
+    uint16_t ttl = 0;
+    switch (msg->type)
+    {
+    case MESSAGE_COMMAND_READ:
+        ttl = msg->msg.read.ttl;
+        break;
+    case MESSAGE_COMMAND_WRITE:
+    case MESSAGE_COMMAND_BROADCAST:
+        ttl = msg->msg.write.ttl;
+        break;
+    case MESSAGE_COMMAND_MASK_WRITE:
+        ttl = msg->msg.mask_write.ttl;
+        break;
+    case MESSAGE_COMMAND_READ_WRITE:
+        ttl = msg->msg.read_write.ttl;
+        break;
+    }
+    if (msg->type == MESSAGE_COMMAND_BROADCAST)
+    {
+        // The bus task orders commands by slave, a broadcast must be queued as one to every slave
+        struct m_command command = *msg;
+        command.device.slave = MODBUS_BROADCAST_ADDRESS;
+        host_queue_command(bus_context, &command, ttl, NULL);
+        return;
+    }
+    host_queue_command(bus_context, msg, ttl, NULL);
+}
+
+void handle_m_block_read(const struct m_block_read *msg, uint8_t len)
+{
+    if (len != sizeof(struct m_block_read))
+    {
+        LOG_ERROR("Block read size doesn't match its payload, %u bytes!", len);
+        return;
+    }
+    struct bus_context *bus_context = bus_get_context(msg->device.bus);
+    if (bus_context == NULL)
+    {
+        LOG_ERROR("Bus %u not configured!", msg->device.bus);
+        return;
+    }
+
+    struct m_block_read *block = pvPortMalloc(sizeof(struct m_block_read));
+    if (block == NULL)
+    {
+        LOG_ERROR("Bus %u could not allocate block read!", msg->device.bus);
+        return;
+    }
+    *block = *msg;
+
+    struct m_command command = {
+        .type = MESSAGE_BLOCK_READ,
+        .seq = msg->seq,
+        .device = msg->device,
+    };
+    host_queue_command(bus_context, &command, msg->ttl, block);
+}
+
+void handle_m_block_write(const struct m_block_write *msg, uint8_t len)
+{
+    // data_size comes from the host, it must match what was received
+    if (sizeof(struct m_block_write) + msg->data_size != len)
+    {
+        LOG_ERROR("Block write size %u doesn't match its payload, %u bytes!", msg->data_size, len);
+        return;
+    }
+    struct bus_context *bus_context = bus_get_context(msg->device.bus);
+    if (bus_context == NULL)
+    {
+        LOG_ERROR("Bus %u not configured!", msg->device.bus);
+        return;
+    }
+    if (msg->data_size > M_BLOCK_DATA_SIZE)
+    {
+        LOG_ERROR("Bus %u block write too long, %u bytes!", msg->device.bus, msg->data_size);
+        return;
+    }
+
+    size_t block_size = sizeof(struct m_block_write) + msg->data_size;
+    struct m_block_write *block = pvPortMalloc(block_size);
+    if (block == NULL)
+    {
+        LOG_ERROR("Bus %u could not allocate block write!", msg->device.bus);
+        return;
+    }
+    memcpy(block, msg, block_size);
+
+    struct m_command command = {
+        .type = MESSAGE_BLOCK_WRITE,
+        .seq = msg->seq,
+        .device = msg->device,
+    };
+    host_queue_command(bus_context, &command, msg->ttl, block);
+}
+
+void handle_m_raw(const struct m_raw *msg, uint8_t len)
 {
-    xQueueSend(bus_get_context(msg->device.bus)->command_queue, msg, FREERTOS_NO_WAIT);
+    // pdu_size comes from the host, it must match what was received
+    if (sizeof(struct m_raw) + msg->pdu_size != len)
+    {
+        LOG_ERROR("Raw PDU size %u doesn't match its payload, %u bytes!", msg->pdu_size, len);
+        return;
+    }
+    struct bus_context *bus_context = bus_get_context(msg->bus);
+    if (bus_context == NULL)
+    {
+        LOG_ERROR("Bus %u not configured!", msg->bus);
+        return;
+    }
+    if (msg->pdu_size == 0 || msg->pdu_size > M_RAW_PDU_SIZE)
+    {
+        LOG_ERROR("Bus %u raw PDU size %u invalid!", msg->bus, msg->pdu_size);
+        return;
+    }
+
+    size_t raw_size = sizeof(struct m_raw) + msg->pdu_size;
+    struct m_raw *raw = pvPortMalloc(raw_size);
+    if (raw == NULL)
+    {
+        LOG_ERROR("Bus %u could not allocate raw command!", msg->bus);
+        return;
+    }
+    memcpy(raw, msg, raw_size);
+
+    struct m_command command = {
+        .type = MESSAGE_RAW,
+        .seq = msg->seq,
+        .device = {
+            .bus = msg->bus,
+            .slave = msg->slave,
+            .function = msg->pdu[0],
+        },
+    };
+    host_queue_command(bus_context, &command, msg->ttl, raw);
 }
 
-void handle_m_pico_reset(const uint8_t *msg)
+void handle_m_pico_reset(const uint8_t *msg, uint8_t len)
 {
+    (void)len;
     (void)msg;
     LOG_ERROR("Pico Resetting");
     watchdog_enable(1, 1); // Enable watchdog and check how to work this out
@@ -96,8 +309,9 @@ void handle_m_pico_reset(const uint8_t *msg)
         ;
 }
 
-void handle_m_dmx_write(const struct m_dmx_write *msg)
+void handle_m_dmx_write(const struct m_dmx_write *msg, uint8_t len)
 {
+    (void)len;
     xQueueSend(dmx_write_queue, msg, FREERTOS_NO_WAIT);
 }
 
@@ -117,7 +331,6 @@ static inline void safe_min_send_frame(uint8_t min_id, uint8_t const *payload, u
 void min_application_handler(uint8_t min_id, uint8_t const *min_payload, uint8_t len_payload, uint8_t port)
 {
     (void)port;
-    (void)len_payload;
 #ifdef HOST_DEBUG_MIN_FRAME
     LOG_DEBUG("Min packet received: ID %u, Size: %u, Payload: %s", min_id, len_payload, to_hex_string(min_payload, len_payload));
 #endif
@@ -127,7 +340,7 @@ void min_application_handler(uint8_t min_id, uint8_t const *min_payload, uint8_t
     {
         if (m_handlers[i].message_id == min_id)
         {
-            m_handlers[i].handler(min_payload);
+            m_handlers[i].handler(min_payload, len_payload);
             return;
         }
     }
@@ -154,8 +367,25 @@ _Noreturn static void task_host_handler(void *arg)
         // Check if there is any change in the queue to be sent to host
         if (xQueueReceive(host_change_queue, &command, 0))
         {
-            LOG_DEBUGD("Sending Change - %04X", &command.device, command.msg.read_reply.data);
-            safe_min_send_frame(MESSAGE_PERIODIC_READ_REPLY, (uint8_t *)&command, sizeof(command));
+            switch (command.type)
+            {
+            case MESSAGE_PERIODIC_READ_REPLY:
+                LOG_DEBUGD("Sending Change - %04X", &command.device, command.msg.periodic_change.data);
+                break;
+            case MESSAGE_PERIODIC_VALUE_REPLY:
+                LOG_DEBUGD("Sending Change - %08lX%08lX Type: %02X", &command.device,
+                           (unsigned long)(command.msg.periodic_value.data >> 32),
+                           (unsigned long)(command.msg.periodic_value.data & 0xFFFFFFFF),
+                           command.msg.periodic_value.type);
+                break;
+            case MESSAGE_SLAVE_STATUS:
+                LOG_DEBUGD("Sending Slave Status - Online: %c", &command.device, LOG_BOOL(command.msg.slave_status.online));
+                break;
+            default:
+                LOG_ERROR("Unknown change type %u", command.type);
+                break;
+            }
+            safe_min_send_frame(command.type, (uint8_t *)&command, sizeof(command));
         }
 
         // Check if there is any command response in the queue to be sent to host
@@ -172,10 +402,19 @@ _Noreturn static void task_host_handler(void *arg)
                            LOG_BOOL(command.msg.config_bus_reply.invalid_bus));
                 break;
             case MESSAGE_COMMAND_READ_REPLY:
-                LOG_DEBUGD("Sending READ Reply Seq: %u Done: %c Data: %04X", &command.device, command.seq, LOG_BOOL(command.msg.read_reply.done), command.msg.read_reply.data);
+                LOG_DEBUGD("Sending READ Reply Seq: %u Done: %c Data: %04X Status: %u Retries: %u", &command.device, command.seq, LOG_BOOL(command.msg.read_reply.done), command.msg.read_reply.data, command.msg.read_reply.status, command.msg.read_reply.retries);
                 break;
             case MESSAGE_COMMAND_WRITE_REPLY:
-                LOG_DEBUGD("Sending WRITE Reply Seq: %u Done: %c", &command.device, command.seq, LOG_BOOL(command.msg.write_reply.done));
+                LOG_DEBUGD("Sending WRITE Reply Seq: %u Done: %c Status: %u Retries: %u", &command.device, command.seq, LOG_BOOL(command.msg.write_reply.done), command.msg.write_reply.status, command.msg.write_reply.retries);
+                break;
+            case MESSAGE_COMMAND_BROADCAST_REPLY:
+                LOG_DEBUGD("Sending BROADCAST Reply Seq: %u Done: %c Status: %u", &command.device, command.seq, LOG_BOOL(command.msg.write_reply.done), command.msg.write_reply.status);
+                break;
+            case MESSAGE_COMMAND_MASK_WRITE_REPLY:
+                LOG_DEBUGD("Sending MASK WRITE Reply Seq: %u Done: %c Status: %u Retries: %u", &command.device, command.seq, LOG_BOOL(command.msg.write_reply.done), command.msg.write_reply.status, command.msg.write_reply.retries);
+                break;
+            case MESSAGE_COMMAND_READ_WRITE_REPLY:
+                LOG_DEBUGD("Sending READ WRITE Reply Seq: %u Done: %c Data: %04X Status: %u Retries: %u", &command.device, command.seq, LOG_BOOL(command.msg.read_reply.done), command.msg.read_reply.data, command.msg.read_reply.status, command.msg.read_reply.retries);
                 break;
             default:
                 LOG_ERROR("Unknown command type %u", command.type);
@@ -184,6 +423,15 @@ _Noreturn static void task_host_handler(void *arg)
             safe_min_send_frame(command.type, (uint8_t *)&command, sizeof(command));
         }
 
+        // Check if there is any variable length message to be sent to host
+        struct host_message *message;
+        if (xQueueReceive(host_message_queue, &message, 0))
+        {
+            LOG_DEBUG("Sending Message Type: %u Size: %u", message->type, message->size);
+            safe_min_send_frame(message->type, message->payload, message->size);
+            vPortFree(message);
+        }
+
         if (IS_EXPIRED(next_heartbeat))
         {
             safe_min_send_frame(MESSAGE_HEARTBEAT, NULL, 0);
@@ -204,6 +452,7 @@ void host_init(void)
 
     host_change_queue = xQueueCreate(HOST_QUEUE_LENGTH, sizeof(struct m_command));
     host_command_queue = xQueueCreate(HOST_QUEUE_LENGTH, sizeof(struct m_command));
+    host_message_queue = xQueueCreate(HOST_MESSAGE_QUEUE_LENGTH, sizeof(struct host_message *));
 
     xTaskCreateAffinitySet(task_host_handler,
                            "Host Handler",
@@ -213,3 +462,28 @@ void host_init(void)
                            HOST_TASK_CORE_AFFINITY,
                            NULL);
 }
+
+struct host_message *host_message_new(uint8_t type, size_t size)
+{
+    if (size > MAX_PAYLOAD)
+    {
+        return NULL;
+    }
+    struct host_message *message = pvPortMalloc(sizeof(struct host_message) + size);
+    if (message != NULL)
+    {
+        message->type = type;
+        message->size = size;
+    }
+    return message;
+}
+
+bool host_message_send(struct host_message *message)
+{
+    if (!xQueueSend(host_message_queue, &message, FREERTOS_NO_WAIT))
+    {
+        vPortFree(message);
+        return false;
+    }
+    return true;
+}
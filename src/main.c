@@ -12,6 +12,7 @@
 #include "host.h"
 #include "dmx.h"
 #include "messages.h"
+#include "modbus_crc.h"
 #include "res_usage.h"
 
 int main()
@@ -54,6 +55,11 @@ int main()
     // Init Peripherals
     LOG_INFO("Initializing Peripherals");
 
+    modbus_crc_init();
+#if MODBUS_CRC_BENCHMARK == 1
+    modbus_crc_benchmark();
+#endif
+
     // Init Tasks
     LOG_INFO("Creating tasks");
 
@@ -3,22 +3,50 @@
 const struct m_handler m_handlers[] = {
     {
         .message_id = MESSAGE_CONFIG_BUS,
-        .handler = (void (*)(const void *))handle_m_config_bus,
+        .handler = (void (*)(const void *, uint8_t))handle_m_config_bus,
     },
     {
         .message_id = MESSAGE_COMMAND_READ,
-        .handler = (void (*)(const void *))handle_m_command,
+        .handler = (void (*)(const void *, uint8_t))handle_m_command,
     },
     {
         .message_id = MESSAGE_COMMAND_WRITE,
-        .handler = (void (*)(const void *))handle_m_command,
+        .handler = (void (*)(const void *, uint8_t))handle_m_command,
+    },
+    {
+        .message_id = MESSAGE_COMMAND_MASK_WRITE,
+        .handler = (void (*)(const void *, uint8_t))handle_m_command,
+    },
+    {
+        .message_id = MESSAGE_COMMAND_READ_WRITE,
+        .handler = (void (*)(const void *, uint8_t))handle_m_command,
+    },
+    {
+        .message_id = MESSAGE_COMMAND_BROADCAST,
+        .handler = (void (*)(const void *, uint8_t))handle_m_command,
+    },
+    {
+        .message_id = MESSAGE_COMMAND_CANCEL,
+        .handler = (void (*)(const void *, uint8_t))handle_m_command,
+    },
+    {
+        .message_id = MESSAGE_BLOCK_READ,
+        .handler = (void (*)(const void *, uint8_t))handle_m_block_read,
+    },
+    {
+        .message_id = MESSAGE_BLOCK_WRITE,
+        .handler = (void (*)(const void *, uint8_t))handle_m_block_write,
+    },
+    {
+        .message_id = MESSAGE_RAW,
+        .handler = (void (*)(const void *, uint8_t))handle_m_raw,
     },
     {
         .message_id = MESSAGE_DMX_WRITE,
-        .handler = (void (*)(const void *))handle_m_dmx_write,
+        .handler = (void (*)(const void *, uint8_t))handle_m_dmx_write,
     },
     {
         .message_id = MESSAGE_PICO_RESET,
-        .handler = (void (*)(const void *))handle_m_pico_reset,
+        .handler = (void (*)(const void *, uint8_t))handle_m_pico_reset,
     },
 };
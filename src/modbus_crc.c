@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include <pico/platform.h>
+#include <pico/time.h>
+#include <hardware/clocks.h>
+#include <hardware/interp.h>
+#include <hardware/sync.h>
+#include "macrologger.h"
+
+#include "modbus_crc.h"
+
+// Not const, so it stays in SRAM
+uint16_t modbus_crc_table[4][256];
+
+// Bitwise CRC of a single byte, to build the tables
+static uint16_t modbus_crc_byte(uint16_t crc, uint8_t byte)
+{
+    crc ^= byte;
+    for (int i = 0; i < 8; i++)
+    {
+        crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+/**
+ * Build the CRC tables, must run before any Modbus frame is built or parsed.
+ */
+void modbus_crc_init(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        modbus_crc_table[0][i] = modbus_crc_byte(0, i);
+    }
+    // Each table advances the CRC of the previous one by one more zero byte
+    for (int t = 1; t < 4; t++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            uint16_t crc = modbus_crc_table[t - 1][i];
+            modbus_crc_table[t][i] = (crc >> 8) ^ modbus_crc_table[0][crc & 0xFF];
+        }
+    }
+}
+
+uint16_t __not_in_flash_func(modbus_crc_update_table)(uint16_t crc, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = (crc >> 8) ^ modbus_crc_table[0][(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+uint16_t __not_in_flash_func(modbus_crc_update_slice4)(uint16_t crc, const uint8_t *data, size_t length)
+{
+    // Byte-wise up to a word boundary, the Cortex-M0+ faults on unaligned word loads
+    while (length > 0 && ((uintptr_t)data & 3))
+    {
+        crc = (crc >> 8) ^ modbus_crc_table[0][(crc ^ *data++) & 0xFF];
+        length--;
+    }
+    while (length >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, __builtin_assume_aligned(data, 4), sizeof(word));
+        word ^= crc;
+        crc = modbus_crc_table[3][word & 0xFF] ^
+              modbus_crc_table[2][(word >> 8) & 0xFF] ^
+              modbus_crc_table[1][(word >> 16) & 0xFF] ^
+              modbus_crc_table[0][word >> 24];
+        data += 4;
+        length -= 4;
+    }
+    while (length-- > 0)
+    {
+        crc = (crc >> 8) ^ modbus_crc_table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+uint16_t __not_in_flash_func(modbus_crc_update_interp)(uint16_t crc, const uint8_t *data, size_t length)
+{
+    // The interpolator is shared by every task of this core, keep its state and don't let them run
+    interp_hw_save_t saved;
+    uint32_t interrupts = save_and_disable_interrupts();
+    interp_save(interp1, &saved);
+
+    // Accumulator 0 holds (crc ^ byte) << 1
+    // Lane 0 peeks the table entry address, lane 1 peeks crc >> 8 from the same accumulator
+    interp_config config = interp_default_config();
+    interp_config_set_shift(&config, 0);
+    interp_config_set_mask(&config, 1, 8);
+    interp_set_config(interp1, 0, &config);
+    config = interp_default_config();
+    interp_config_set_cross_input(&config, true);
+    interp_config_set_shift(&config, 9);
+    interp_config_set_mask(&config, 0, 7);
+    interp_set_config(interp1, 1, &config);
+    interp1->base[0] = (uintptr_t)modbus_crc_table[0];
+    interp1->base[1] = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        interp1->accum[0] = (uint32_t)(crc ^ data[i]) << 1;
+        crc = *(const uint16_t *)(uintptr_t)interp1->peek[0] ^ interp1->peek[1];
+    }
+
+    interp_restore(interp1, &saved);
+    restore_interrupts(interrupts);
+    return crc;
+}
+
+#if MODBUS_CRC_BENCHMARK == 1
+
+// Bytes per run, the largest frame, and runs per back end
+#define MODBUS_CRC_BENCHMARK_SIZE 256
+#define MODBUS_CRC_BENCHMARK_RUNS 1000
+
+static void modbus_crc_benchmark_run(const char *name,
+                                     uint16_t (*update)(uint16_t, const uint8_t *, size_t),
+                                     const uint8_t *data,
+                                     uint16_t expected)
+{
+    uint16_t crc = 0;
+    uint64_t start_us = time_us_64();
+    for (int i = 0; i < MODBUS_CRC_BENCHMARK_RUNS; i++)
+    {
+        crc = update(0xFFFF, data, MODBUS_CRC_BENCHMARK_SIZE);
+    }
+    uint64_t elapsed_us = time_us_64() - start_us;
+
+    // The Cortex-M0+ has no cycle counter, cycles come from the elapsed time at the system clock
+    uint64_t cycles = elapsed_us * (clock_get_hz(clk_sys) / 1000000);
+    uint32_t centi_cycles = (uint32_t)(cycles * 100 / (MODBUS_CRC_BENCHMARK_RUNS * MODBUS_CRC_BENCHMARK_SIZE));
+    LOG_INFO("CRC %-6s %lu.%02lu cycles/byte%s", name,
+             (unsigned long)(centi_cycles / 100), (unsigned long)(centi_cycles % 100),
+             crc == expected ? "" : ", wrong CRC!");
+}
+
+/**
+ * Report the cycles per byte of each CRC back end, run before the scheduler starts.
+ */
+void modbus_crc_benchmark(void)
+{
+    static uint8_t data[MODBUS_CRC_BENCHMARK_SIZE];
+    uint16_t expected = 0xFFFF;
+    for (int i = 0; i < MODBUS_CRC_BENCHMARK_SIZE; i++)
+    {
+        data[i] = i * 31 + 7;
+        expected = modbus_crc_byte(expected, data[i]);
+    }
+
+    LOG_INFO("CRC benchmark, %u bytes, %u runs, engine in use: %u",
+             MODBUS_CRC_BENCHMARK_SIZE, MODBUS_CRC_BENCHMARK_RUNS, MODBUS_CRC_ENGINE);
+    modbus_crc_benchmark_run("table", modbus_crc_update_table, data, expected);
+    modbus_crc_benchmark_run("slice4", modbus_crc_update_slice4, data, expected);
+    modbus_crc_benchmark_run("interp", modbus_crc_update_interp, data, expected);
+}
+
+#endif // MODBUS_CRC_BENCHMARK == 1
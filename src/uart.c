@@ -152,6 +152,7 @@ void pio_uart_init(struct pio_uart *const pio_uart)
     pio_uart->super.tx_buffer_mutex = xSemaphoreCreateMutex();
     pio_uart->super.tx_buffer_overrun = false;
     pio_uart->super.tx_done = true;
+    pio_uart->super.tx_done_signal = xSemaphoreCreateBinary();
 
     pio_uart->super.rx_buffer = xStreamBufferCreate(UART_BUFFER_SIZE, sizeof(uint8_t));
     pio_uart->super.rx_buffer_mutex = xSemaphoreCreateMutex();
@@ -226,15 +227,24 @@ static inline void pio_uart_tx_fifo_irq_enabled(struct pio_uart *uart, bool enab
 
 static void pio_uart_tx_done_isr(void)
 {
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
     for (size_t i = 0; active_pio_uarts[i] != NULL; i++)
     {
         struct pio_uart *uart = active_pio_uarts[i];
         if (pio_interrupt_get(uart->tx_pio, uart->tx_sm))
         {
-            uart->super.tx_done = true;
             pio_interrupt_clear(uart->tx_pio, uart->tx_sm);
+            // The IRQ is raised after the stop bit of each byte, we are done only if there is nothing left
+            if (xStreamBufferIsEmpty(uart->super.tx_buffer) && pio_sm_is_tx_fifo_empty(uart->tx_pio, uart->tx_sm))
+            {
+                BaseType_t taskWoken = pdFALSE;
+                uart->super.tx_done = true;
+                xSemaphoreGiveFromISR(uart->super.tx_done_signal, &taskWoken);
+                xHigherPriorityTaskWoken |= taskWoken;
+            }
         }
     }
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
 
 static void pio_uart_tx_fifo_isr(void)
@@ -263,17 +273,22 @@ static void pio_uart_tx_fifo_isr(void)
 
 static void pio_uart_rx_isr(void)
 {
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
     for (size_t i = 0; active_pio_uarts[i] != NULL; i++)
     {
         struct pio_uart *uart = active_pio_uarts[i];
+        BaseType_t taskWoken = pdFALSE;
         while (!pio_rx_empty(uart))
         {
             uint8_t data = pio_rx_getc(uart);
-            bool ret = xStreamBufferSendFromISR(uart->super.rx_buffer, &data, 1, NULL);
+            // Wakes the task blocked reading this UART, if any
+            bool ret = xStreamBufferSendFromISR(uart->super.rx_buffer, &data, 1, &taskWoken);
             uart->super.rx_buffer_overrun |= !ret;
             uart->super.activity = true;
         }
+        xHigherPriorityTaskWoken |= taskWoken;
     }
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
 
 //
@@ -298,36 +313,51 @@ inline size_t hw_uart_write_bytes_blocking(struct hw_uart *const uart, const voi
 
 inline size_t pio_uart_write_bytes_blocking(struct pio_uart *const uart, const void *src, size_t size)
 {
+    xSemaphoreTake(uart->super.tx_done_signal, FREERTOS_NO_WAIT); // Clear any previous TX done
     size_t bytes_written = _uart_write_bytes(&uart->super, src, size, true);
     pio_uart_tx_fifo_irq_enabled(uart, true);
     return bytes_written;
 }
 
+bool pio_uart_wait_tx_done(struct pio_uart *const uart, TickType_t timeout)
+{
+    if (uart->super.tx_done)
+    {
+        return true;
+    }
+    return xSemaphoreTake(uart->super.tx_done_signal, timeout) == pdTRUE;
+}
+
 // Read
 
-static inline size_t _uart_read_bytes(struct uart *const uart, void *dst, uint8_t size, bool blocking)
+static inline size_t _uart_read_bytes(struct uart *const uart, void *dst, size_t size, TickType_t wait)
+{
+    return xStreamBufferReceive(uart->rx_buffer, (uint8_t *)dst, size, wait);
+}
+
+inline size_t hw_uart_read_bytes(struct hw_uart *const uart, void *dst, size_t size)
 {
-    return xStreamBufferReceive(uart->rx_buffer, (uint8_t *)dst, size, (blocking ? portMAX_DELAY : FREERTOS_NO_WAIT));
+    return _uart_read_bytes(&uart->super, dst, size, FREERTOS_NO_WAIT);
 }
 
-inline size_t hw_uart_read_bytes(struct hw_uart *const uart, void *dst, uint8_t size)
+inline size_t hw_uart_read_bytes_blocking(struct hw_uart *const uart, void *dst, size_t size)
 {
-    return _uart_read_bytes(&uart->super, dst, size, false);
+    return _uart_read_bytes(&uart->super, dst, size, portMAX_DELAY);
 }
 
-inline size_t hw_uart_read_bytes_blocking(struct hw_uart *const uart, void *dst, uint8_t size)
+inline size_t pio_uart_read_bytes(struct pio_uart *const uart, void *dst, size_t size)
 {
-    return _uart_read_bytes(&uart->super, dst, size, true);
+    return _uart_read_bytes(&uart->super, dst, size, FREERTOS_NO_WAIT);
 }
 
-inline size_t pio_uart_read_bytes(struct pio_uart *const uart, void *dst, uint8_t size)
+inline size_t pio_uart_read_bytes_blocking(struct pio_uart *const uart, void *dst, size_t size)
 {
-    return _uart_read_bytes(&uart->super, dst, size, false);
+    return _uart_read_bytes(&uart->super, dst, size, portMAX_DELAY);
 }
 
-inline size_t pio_uart_read_bytes_blocking(struct pio_uart *const uart, void *dst, uint8_t size)
+inline size_t pio_uart_read_bytes_timeout(struct pio_uart *const uart, void *dst, size_t size, TickType_t timeout)
 {
-    return _uart_read_bytes(&uart->super, dst, size, true);
+    return _uart_read_bytes(&uart->super, dst, size, timeout);
 }
 
 // Flush
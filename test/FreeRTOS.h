@@ -0,0 +1,14 @@
+#ifndef TEST_FREERTOS_H_
+#define TEST_FREERTOS_H_
+
+//
+// Just what the logger needs to build the host tests, the firmware uses the real FreeRTOS
+//
+
+#include <stdint.h>
+
+typedef unsigned long TickType_t;
+
+TickType_t xTaskGetTickCount(void);
+
+#endif // TEST_FREERTOS_H_
@@ -0,0 +1,138 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "modbus_parser.h"
+#include "modbus_framer.h"
+
+//
+// Host test of a single read, from the request frame to the value replied to the host.
+// The CRC tables are built here and FreeRTOS is stubbed in test/, the rest needs the Pico SDK.
+//
+
+uint16_t modbus_crc_table[4][256];
+
+uint16_t modbus_crc_update_table(uint16_t crc, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = (crc >> 8) ^ modbus_crc_table[0][(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+uint16_t modbus_crc_update_slice4(uint16_t crc, const uint8_t *data, size_t length)
+{
+    return modbus_crc_update_table(crc, data, length);
+}
+
+uint16_t modbus_crc_update_interp(uint16_t crc, const uint8_t *data, size_t length)
+{
+    return modbus_crc_update_table(crc, data, length);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return 0;
+}
+
+static void crc_init(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t crc = i;
+        for (int b = 0; b < 8; b++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+        modbus_crc_table[0][i] = crc;
+    }
+}
+
+static int failures = 0;
+
+#define CHECK(cond)                                                  \
+    do                                                               \
+    {                                                                \
+        if (!(cond))                                                 \
+        {                                                            \
+            printf("%s:%d: FAILED %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                              \
+        }                                                            \
+    } while (0)
+
+/**
+ * Parse a reply to a single read as process_read_command does, reply without its CRC.
+ * @return true if the reply is valid, with its value in 'value'.
+ */
+static bool read_reply(enum modbus_function function,
+                       uint8_t slave,
+                       uint16_t address,
+                       const uint8_t *reply,
+                       size_t reply_size,
+                       uint16_t *value)
+{
+    uint8_t tx_frame[MODBUS_ADU_SIZE];
+    size_t tx_frame_size = modbus_create_read_frame(function, slave, address, tx_frame, sizeof(tx_frame));
+    CHECK(tx_frame_size > 0);
+
+    // The CRC is right after the data in the buffer, the parser must not take it as data
+    uint8_t rx_buffer[MODBUS_ADU_SIZE];
+    uint8_t rx_frame_bytes[MODBUS_ADU_SIZE];
+    memcpy(rx_frame_bytes, reply, reply_size);
+    uint16_t crc = compute_crc(reply, reply_size);
+    rx_frame_bytes[reply_size] = crc & 0xFF;
+    rx_frame_bytes[reply_size + 1] = crc >> 8;
+
+    struct modbus_parser parser;
+    struct modbus_frame rx_frame = {0};
+    modbus_parser_expect(&parser, rx_buffer, sizeof(rx_buffer), slave, function,
+                         modbus_expected_response_size(tx_frame, tx_frame_size));
+    if (modbus_parser_process_buffer(&parser, &rx_frame, rx_frame_bytes, reply_size + 2) != MODBUS_COMPLETE)
+    {
+        return false;
+    }
+    return modbus_read_frame_value(function, address, rx_frame.data, rx_frame.data_size, value);
+}
+
+int main(void)
+{
+    crc_init();
+    uint16_t value;
+
+    // Coils 0 to 3 of slave 5, a single data byte. Coils go first byte on the high byte.
+    const uint8_t coils_4[] = {0x05, 0x01, 0x01, 0x0B};
+    CHECK(read_reply(MODBUS_FUNCTION_READ_COILS, 5, 3, coils_4, sizeof(coils_4), &value));
+    CHECK(value == 0x0B00);
+
+    // Discrete inputs pack their address as coils
+    CHECK(read_reply(MODBUS_FUNCTION_READ_DISCRETE_INPUTS, 5, 7, (const uint8_t[]){0x05, 0x02, 0x01, 0x81}, 4, &value));
+    CHECK(value == 0x8100);
+
+    // Coils 0 to 15, both bytes
+    const uint8_t coils_16[] = {0x05, 0x01, 0x02, 0x0B, 0xA0};
+    CHECK(read_reply(MODBUS_FUNCTION_READ_COILS, 5, 15, coils_16, sizeof(coils_16), &value));
+    CHECK(value == 0x0BA0);
+
+    // A reply for fewer coils than asked is an error
+    CHECK(!read_reply(MODBUS_FUNCTION_READ_COILS, 5, 15, coils_4, sizeof(coils_4), &value));
+
+    // A single holding register
+    const uint8_t register_1[] = {0x05, 0x03, 0x02, 0x12, 0x34};
+    CHECK(read_reply(MODBUS_FUNCTION_READ_HOLDING_REGISTERS, 5, 100, register_1, sizeof(register_1), &value));
+    CHECK(value == 0x1234);
+
+    // A short register reply is an error
+    CHECK(!read_reply(MODBUS_FUNCTION_READ_HOLDING_REGISTERS, 5, 100,
+                      (const uint8_t[]){0x05, 0x03, 0x01, 0x12}, 4, &value));
+
+    if (failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef TEST_TASK_H_
+#define TEST_TASK_H_
+
+#include "FreeRTOS.h"
+
+#endif // TEST_TASK_H_